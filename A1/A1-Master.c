@@ -13,119 +13,385 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
-#include <sys/sem.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <errno.h>
+#include "channel.h"
 
 #define TRUE 1
+#define FALSE 0
 #define MAX 20
 #define THRESHOLD 100
+#define MAX_EVENTS 8
+#define MAX_SLAVES 64
+
+// how payloads are spread over the slaves (-p)
+typedef enum { SPREAD_RR, SPREAD_LEAST, SPREAD_HASH } spread_t;
+const char *spread_names[] = {"rr", "least", "hash"};
 
 int terminated; // flag to signal termination
 
-// semaphores
-sem_t *sem_sig;
-sem_t *sem_parent_done;
+// options
+channel_mode_t mode=CHANNEL_SHMEM; // -t
+long rate=0; // -r
+long long threshold=THRESHOLD; // -l
+int quiet=FALSE; // -q
+int n_slaves=1; // -n
+spread_t spread=SPREAD_RR; // -p
+char *slave_path=NULL; // -x, spawn the slaves instead of attaching to them
 
-// signal handler
-void handler(int signo) {
-	if(signo==SIGUSR1) {
-		// send signal to child
-		sem_post(sem_sig);
-	}
-	else {
-		// abort
-		perror("Wrong signal number");
-		abort();
+// the channel to one slave, with the payloads generated for it and not sent yet
+typedef struct link_t {
+	channel_t ch;
+	int out_fd; // descriptor to watch for room: the pipe, or the eventfd of the ring
+	int pending[CHANNEL_BATCH], n_pending, n_sent; // generated, sent up to n_sent
+	long outstanding; // sent and not taken by the slave, as of the last flush
+	long total; // payloads sent
+	int blocked; // the channel did not take all of pending
+} link_t;
+
+// state of the sender: triggers add to owed, payloads are generated from owed into the
+// pending payloads of a link and leave it as fast as its channel takes them. A link
+// whose pending payloads are full is skipped, and when no link can take the next
+// payload generation stops: triggers keep adding to owed until the slaves catch up
+typedef struct sender_t {
+	link_t link[MAX_SLAVES];
+	long owed; // payloads triggered and not generated yet
+	int next, has_next; // payload generated and not placed yet
+	int rr; // next link for SPREAD_RR
+	long long accumulator; // to keep track of the total sum of sent numbers, over all slaves
+} sender_t;
+
+// payloads a link has not delivered yet
+long backlog(link_t *k) {
+	return k->outstanding+k->n_pending-k->n_sent;
+}
+
+// the link for payload, or -1 if it has to wait
+int pick(sender_t *s, int payload) {
+	int i, l, best=-1;
+	switch(spread) {
+	case SPREAD_RR:
+		for(i=0;i<n_slaves;i++) {
+			l=(s->rr+i)%n_slaves;
+			if(s->link[l].n_pending<CHANNEL_BATCH) {
+				s->rr=l+1;
+				return l;
+			}
+		}
+		return -1;
+	case SPREAD_LEAST:
+		for(l=0;l<n_slaves;l++) {
+			if(s->link[l].n_pending<CHANNEL_BATCH && (best==-1 || backlog(&s->link[l])<backlog(&s->link[best])))
+				best=l;
+		}
+		return best;
+	case SPREAD_HASH: // the same value always goes to the same slave
+		l=((unsigned)payload*2654435761u>>16)%n_slaves;
+		return s->link[l].n_pending<CHANNEL_BATCH ? l : -1;
 	}
+	return -1;
 }
 
-int main(void) {
-	// create fifo for write
-	if(mkfifo("/tmp/named_pipe", 0666) == -1) {
-		if (errno != EEXIST) {
-			perror("Error creating named pipe");
-			exit (1);
+// generates owed payloads while some link has room for them
+void generate(sender_t *s) {
+	int l;
+	while(!terminated && s->owed>0) {
+		if(!s->has_next) {
+			s->next = rand()%MAX; // the payload is the number to send to slave
+			s->has_next=TRUE;
+		}
+		if((l=pick(s, s->next)) == -1)
+			return;
+		s->has_next=FALSE;
+		s->accumulator+=s->next;
+		if(!quiet)
+			printf("payload: %d; accumulator: %lld; slave: %d\n", s->next, s->accumulator, l);
+		s->link[l].pending[s->link[l].n_pending++]=s->next;
+		s->owed--;
+		if(s->accumulator>threshold) {
+			terminated = TRUE; // terminate successfully
 		}
 	}
+}
 
-	// set up semaphores
-	sem_sig = sem_open("/sem_sig", O_CREAT, 0644, 0);
-	sem_parent_done = sem_open("/sem_parent_done", O_CREAT, 0644, 0);
+// sends what the channel takes without blocking; sets blocked if payloads are left
+void flush(link_t *k) {
+	int n=0;
+	if(k->n_sent<k->n_pending)
+		n=channel_try_send_batch(&k->ch, k->pending+k->n_sent, k->n_pending-k->n_sent);
+	if(n==-1) {
+		perror("Error writing to channel");
+		exit (1);
+	}
+	k->n_sent+=n;
+	k->total+=n;
+	k->blocked=k->n_sent<k->n_pending;
+	if(!k->blocked)
+		k->n_pending=k->n_sent=0;
+	if(spread==SPREAD_LEAST)
+		k->outstanding=channel_outstanding(&k->ch);
+}
 
-	// set up signal handler
-	signal(SIGUSR1, handler);
+// watches a link for room while it is blocked: the pipe for writing, the eventfd of the
+// ring for reading
+void watch(int epfd, link_t *k) {
+	struct epoll_event ev;
+	ev.events=!k->blocked ? 0 : k->ch.mode==CHANNEL_PIPE ? EPOLLOUT : EPOLLIN;
+	ev.data.fd=k->out_fd;
+	epoll_ctl(epfd, EPOLL_CTL_MOD, k->out_fd, &ev);
+}
 
-	puts("!!!Hello World - I'm the master!!!");
-	// set up seed
-	srand(1);
+// stdin: an empty line triggers one payload, a number that many, q stops
+void read_control(sender_t *s, int fd, int epfd) {
+	static char line[256];
+	static int len;
+	char *nl;
+	int n=read(fd, line+len, sizeof(line)-1-len);
+	if(n<=0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+		return;
+	}
+	len+=n;
+	line[len]='\0';
+	while((nl=strchr(line, '\n')) != NULL) {
+		*nl='\0';
+		if(line[0]=='q')
+			terminated = TRUE;
+		else
+			s->owed+=line[0]=='\0' ? 1 : atol(line);
+		len-=nl+1-line;
+		memmove(line, nl+1, len+1);
+	}
+	if(len==sizeof(line)-1) // no newline in sight, drop it
+		len=0;
+}
 
-	pid_t pid = fork();
-	if(pid==-1) {
-		perror("Error creating child");
+// the sender: an epoll loop over SIGUSR1 (one payload per signal) and SIGINT/SIGTERM
+// (stop) from a signalfd, the timerfd of -r, stdin and, while payloads are waiting for
+// room, the pipes to the slaves or the eventfds their rings signal once the slave took
+// a payload
+void sender(sigset_t *mask) {
+	static sender_t s;
+	struct epoll_event ev, events[MAX_EVENTS];
+	struct signalfd_siginfo si;
+	struct itimerspec its={{0,0},{0,0}};
+	struct timespec start, end;
+	long total=0, carry=0; // carry: thousandths of a payload left over by past ticks
+	uint64_t expirations;
+	int epfd, sfd, tfd=-1, i, n, l, was_blocked, pending, room;
+	link_t *k;
+
+	epfd=epoll_create1(EPOLL_CLOEXEC);
+	sfd=signalfd(-1, mask, SFD_NONBLOCK|SFD_CLOEXEC);
+	if(epfd==-1 || sfd==-1) {
+		perror("Error setting up the event loop");
 		exit (1);
 	}
-	else if(pid==0) {
 
-		sem_wait(sem_parent_done); // wait until the parent is done
+	for(l=0;l<n_slaves;l++) {
+		k=&s.link[l];
+		printf(mode==CHANNEL_PIPE ? "Opening FIFO %d, waiting for slave to be ready...\n" : "Creating shared memory channel %d...\n", l);
+
+		if(channel_open_writer(&k->ch, mode, l) == -1) {
+			perror("Error opening channel");
+			exit (1);
+		}
 
-		printf("Opening FIFO, waiting for slave to be ready...\n");
+		printf(mode==CHANNEL_PIPE ? "Opened named pipe %d, slave's ready\n" : "Channel %d ready\n", l);
 
-		int fd = open("/tmp/named_pipe", O_WRONLY);
-		if(fd==-1) {
-			perror("Error opening named pipe");
+		k->out_fd=channel_nonblock(&k->ch);
+		if(k->out_fd==-1) {
+			perror("Error setting up the channel");
 			exit (1);
 		}
+		ev.events=0; // only while blocked
+		ev.data.fd=k->out_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, k->out_fd, &ev);
+	}
 
-		printf("Opened named pipe, slave's ready\n");
+	ev.events=EPOLLIN;
+	ev.data.fd=sfd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, sfd, &ev);
+	ev.data.fd=STDIN_FILENO;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, STDIN_FILENO, &ev); // fails, and is left out, if stdin is a file
+	if(rate>0) {
+		// up to 1000 ticks per second, faster rates send rate/1000 payloads per tick, the
+		// fraction carried over to the next ticks
+		tfd=timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+		if(rate<=1000)
+			its.it_interval.tv_nsec=1000000000L/rate;
+		else
+			its.it_interval.tv_nsec=1000000;
+		its.it_value=its.it_interval;
+		if(tfd==-1 || timerfd_settime(tfd, 0, &its, NULL) == -1) {
+			perror("Error setting up the timer");
+			exit (1);
+		}
+		ev.data.fd=tfd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+	}
 
-		int payload, // the payload is the number to send to slave
-			accumulator=0; // to keep track of the total sum of sent numbers
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;) {
+		generate(&s);
+		pending=room=FALSE;
+		for(l=0;l<n_slaves;l++) {
+			k=&s.link[l];
+			was_blocked=k->blocked;
+			if(was_blocked)
+				channel_room_seen(&k->ch);
+			flush(k);
+			// a ring the slave emptied before it saw the request needs no wakeup
+			if(k->blocked)
+				room|=channel_want_room(&k->ch);
+			if(k->blocked!=was_blocked)
+				watch(epfd, k);
+			pending|=k->blocked;
+		}
+		if(terminated && !pending)
+			break;
 
-		while(!terminated) {
-			payload = rand()%MAX;
-			accumulator+=payload;
+		// with payloads still owed and room for them only look at what already happened
+		n=epoll_wait(epfd, events, MAX_EVENTS, room || (s.owed>0 && !terminated && !pending) ? 0 : -1);
+		if(n==-1 && errno!=EINTR) {
+			perror("Error waiting for events");
+			exit (1);
+		}
+		for(i=0;i<n;i++) {
+			if(events[i].data.fd==sfd) {
+				while(read(sfd, &si, sizeof(si)) == sizeof(si)) {
+					if(si.ssi_signo==SIGUSR1)
+						s.owed++;
+					else
+						terminated = TRUE;
+				}
+			}
+			else if(events[i].data.fd==tfd) {
+				if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+					continue;
+				if(rate<=1000)
+					s.owed+=expirations;
+				else {
+					carry+=rate*(long)expirations;
+					s.owed+=carry/1000;
+					carry%=1000;
+				}
+			}
+			else if(events[i].data.fd==STDIN_FILENO) {
+				read_control(&s, STDIN_FILENO, epfd);
+			}
+			// a pipe or a ring with room is flushed at the top of the loop
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
 
-			sem_wait(sem_sig); // wait for signal from kill command
+	for(l=0;l<n_slaves;l++) {
+		channel_close(&s.link[l].ch, TRUE); // no more payloads
+		total+=s.link[l].total;
+		if(n_slaves>1)
+			printf("Slave %d: %ld payloads\n", l, s.link[l].total);
+	}
+	printf("Sent %ld payloads in %.3f s\n", total, end.tv_sec-start.tv_sec+(end.tv_nsec-start.tv_nsec)/1e9);
+	puts("All done. Bye!");
+}
 
-			printf("payload: %d; accumulator: %d\n", payload, accumulator);
+// starts slave id from slave_path; the signals stay blocked, so the slaves end when
+// their channel does, even on a Ctrl-C meant for the master
+pid_t spawn(int id) {
+	char arg_id[16];
+	pid_t pid;
+	snprintf(arg_id, sizeof(arg_id), "%d", id);
+	pid=fork();
+	if(pid==0) {
+		execl(slave_path, slave_path, "-t", mode==CHANNEL_PIPE ? "fifo" : "shm", "-i", arg_id, (char *)NULL);
+		perror("Error starting slave");
+		exit (1);
+	}
+	return pid;
+}
 
-			if (write(fd, &payload, 1) == -1){ // send payload to slave
-				perror("Error writing to pipe");
-				exit (1);
-			}
+int main(int argc, char *argv[]) {
+	int i, opt;
+	sigset_t mask;
 
-			if(accumulator>THRESHOLD) {
-				terminated = TRUE; // terminate successfully
-			}
+	// command line: -t shm|fifo selects the channel to the slaves (shared memory by
+	// default), which must be started with the same one. -n sets the number of slaves,
+	// started by hand with -i 0..n-1 or by the master from the program given with -x;
+	// -p rr|least|hash spreads the payloads round robin, to the slave with fewest not
+	// taken yet or by value. -r sends that many payloads per second besides the ones
+	// triggered by signals and stdin, -l sets the sum to go past over all slaves
+	// (THRESHOLD by default), -q stops printing every payload
+	while((opt=getopt(argc, argv, "t:n:p:x:r:l:q")) != -1) {
+		if(opt=='t' && channel_parse_mode(optarg, &mode) == 0)
+			continue;
+		else if(opt=='n' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_SLAVES)
+			n_slaves=atoi(optarg);
+		else if(opt=='p' && strcmp(optarg, "rr")==0)
+			spread=SPREAD_RR;
+		else if(opt=='p' && strcmp(optarg, "least")==0)
+			spread=SPREAD_LEAST;
+		else if(opt=='p' && strcmp(optarg, "hash")==0)
+			spread=SPREAD_HASH;
+		else if(opt=='x')
+			slave_path=optarg;
+		else if(opt=='r' && atol(optarg) > 0)
+			rate=atol(optarg);
+		else if(opt=='l' && atoll(optarg) > 0)
+			threshold=atoll(optarg);
+		else if(opt=='q')
+			quiet=TRUE;
+		else {
+			fprintf(stderr, "Usage: %s [-t shm|fifo] [-n 1..%d] [-p rr|least|hash] [-x slave] [-r payloads/s] [-l threshold] [-q]\n", argv[0], MAX_SLAVES);
+			exit(1);
 		}
+	}
+
+	// the signals are read from a signalfd by the sender, so they stay blocked; the
+	// mask is inherited across fork
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+
+	puts("!!!Hello World - I'm the master!!!");
+	// set up seed
+	srand(1);
 
-		close(fd); // close fifo
-		puts("All done. Bye!");
+	pid_t pid = fork();
+	if(pid==-1) {
+		perror("Error creating child");
+		exit (1);
+	}
+	else if(pid==0) {
+		// the slaves wait for their channel, so the sender need not wait for them
+		sender(&mask);
 	}
 	else {
 
 		printf("Type <kill -%d %d> to send payload\n", SIGUSR1, pid);
+		printf("Spreading over %d slave%s, %s\n", n_slaves, n_slaves>1 ? "s" : "", spread_names[spread]);
 
-		sem_post(sem_parent_done); // signal that the parent is done
+		if(slave_path!=NULL) {
+			for(i=0;i<n_slaves;i++) {
+				if(spawn(i) == -1) {
+					perror("Error creating slave");
+					exit (1);
+				}
+			}
+		}
 
-		wait(NULL); // wait for child to terminate
+		while(wait(NULL) > 0); // wait for child and slaves to terminate
 
 		puts("Child terminated. Bye!");
 	}
 
-	// tidy up semaphores
-	sem_close(sem_sig);
-	sem_close(sem_parent_done);
-	sem_unlink("/sem_sig");
-	sem_unlink("/sem_child_ready");
-	sem_unlink("/sem_parent_done");
-	sem_unlink("/sem_child_done");
-
 	return EXIT_SUCCESS;
 }
-
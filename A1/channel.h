@@ -0,0 +1,440 @@
+/*
+ ============================================================================
+ Name        : channel.h
+ Author      : Andrea Alboni
+ Version     : 1
+ Copyright   : For personal use only
+ Description : Master to slave channel of A1: a ring in shared memory, or
+               framed batches on the named pipe as a fallback
+ ============================================================================
+*/
+
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+#include <pthread.h>
+
+#define CHANNEL_FIFO "/tmp/named_pipe" // followed by the slave id
+#define CHANNEL_SHM "/a1_channel" // followed by the slave id
+#define CHANNEL_SLOTS 1024 // payloads the ring holds, a power of two
+#define CHANNEL_BATCH 1000 // max payloads per frame, so that a frame fits PIPE_BUF
+#define CHANNEL_MAGIC 0xA1F0
+
+// frames on the pipe: a header, then count payloads. The checksum covers type, count
+// and payloads. The master ends the stream with an END frame, so the slave can tell
+// the end from a master that died
+typedef enum { FRAME_DATA = 1, FRAME_END } frame_type_t;
+
+typedef struct frame_header_t {
+	uint16_t magic, type;
+	uint32_t count;
+	uint32_t sum;
+} frame_header_t;
+
+typedef enum { CHANNEL_SHMEM, CHANNEL_PIPE } channel_mode_t;
+
+// single producer, single consumer ring shared by master and slave. head and tail count
+// the payloads taken and stored, without wrapping. A side that finds the ring empty
+// (full) raises its waiting flag and sleeps on its wake word; the other side bumps that
+// word and issues the futex wake only if the flag is up, so there are no syscalls while
+// payloads flow. The master creates the object, the slave removes its name once mapped
+typedef struct channel_ring_t {
+	_Alignas(64) atomic_uint tail; // written by the master
+	atomic_uint closed; // set by the master after the last payload
+	atomic_uint writer_waiting, writer_wake;
+	_Alignas(64) atomic_uint head; // written by the slave
+	atomic_uint reader_waiting, reader_wake;
+	_Alignas(64) int slot[CHANNEL_SLOTS];
+} channel_ring_t;
+
+typedef struct channel_t {
+	channel_mode_t mode;
+	int fd; // named pipe
+	channel_ring_t *ring; // shared memory
+	int wake_fd; // master side of the ring, non-blocking: eventfd readable after the slave made room
+	pthread_t doorbell; // turns the slave's wakeups into writes to wake_fd, see channel_nonblock
+	// slave side of the pipe: bytes read and not parsed yet start at rx_pos; the first
+	// rx_left payloads there belong to a frame already checked
+	unsigned char rx[2 * (sizeof(frame_header_t) + CHANNEL_BATCH * sizeof(int))];
+	int rx_len, rx_pos, rx_left, ended;
+} channel_t;
+
+// futexes in shared memory, so not the private ones
+static inline void channel_futex(atomic_uint *word, int op, unsigned val) {
+	syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+static inline void channel_wake(atomic_uint *wake) {
+	atomic_fetch_add(wake, 1);
+	channel_futex(wake, FUTEX_WAKE, 1);
+}
+
+// FNV-1a over type, count and payloads
+static inline uint32_t frame_checksum(const frame_header_t *h, const void *payloads) {
+	const unsigned char *p=payloads;
+	uint32_t sum=2166136261u, x[2]={h->type, h->count};
+	size_t i;
+	for(i=0;i<sizeof(x);i++)
+		sum=(sum^((unsigned char *)x)[i])*16777619u;
+	for(i=0;i<h->count*sizeof(int);i++)
+		sum=(sum^p[i])*16777619u;
+	return sum;
+}
+
+// one frame with a single writev; a frame up to PIPE_BUF is written whole, a short
+// write is finished with plain writes anyway
+static inline int frame_write(int fd, frame_type_t type, const int *payloads, int n) {
+	frame_header_t h={CHANNEL_MAGIC, type, n, 0};
+	struct iovec iov[2]={{&h, sizeof(h)}, {(void *)payloads, n*sizeof(int)}};
+	size_t total=sizeof(h)+n*sizeof(int), done=0;
+	ssize_t w;
+	h.sum=frame_checksum(&h, payloads);
+	w=writev(fd, iov, 2);
+	if(w==-1)
+		return -1;
+	for(done=w;done<total;done+=w) {
+		if(done<sizeof(h))
+			w=write(fd, (char *)&h+done, sizeof(h)-done);
+		else
+			w=write(fd, (const char *)payloads+done-sizeof(h), total-done);
+		if(w==-1)
+			return -1;
+	}
+	return 0;
+}
+
+// -t shm|fifo; returns -1 if unknown
+static inline int channel_parse_mode(const char *s, channel_mode_t *mode) {
+	if(strcmp(s,"shm")==0)
+		*mode=CHANNEL_SHMEM;
+	else if(strcmp(s,"fifo")==0)
+		*mode=CHANNEL_PIPE;
+	else
+		return -1;
+	return 0;
+}
+
+// name of the channel to slave id
+static inline void channel_name(char *name, size_t len, channel_mode_t mode, int id) {
+	snprintf(name, len, "%s%d", mode==CHANNEL_PIPE ? CHANNEL_FIFO : CHANNEL_SHM, id);
+}
+
+// master side of the channel to slave id; the pipe blocks until the slave opens it, the
+// ring does not. Returns -1 with errno set on failure, like open()
+static inline int channel_open_writer(channel_t *c, channel_mode_t mode, int id) {
+	char name[64];
+	int fd;
+	channel_name(name, sizeof(name), mode, id);
+	c->mode=mode;
+	c->fd=-1;
+	c->ring=NULL;
+	c->wake_fd=-1;
+	if(mode==CHANNEL_PIPE) {
+		if(mkfifo(name, 0666) == -1 && errno != EEXIST)
+			return -1;
+		c->fd=open(name, O_WRONLY);
+		return c->fd==-1?-1:0;
+	}
+	shm_unlink(name); // left over by a run the slave never joined
+	fd=shm_open(name, O_CREAT|O_EXCL|O_RDWR, 0666);
+	if(fd==-1)
+		return -1;
+	// a new object is all zeros, which is an empty ring
+	if(ftruncate(fd, sizeof(channel_ring_t)) == -1) {
+		close(fd);
+		return -1;
+	}
+	c->ring=mmap(NULL, sizeof(channel_ring_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	return c->ring==MAP_FAILED?-1:0;
+}
+
+// slave side; waits until the master has created the channel
+static inline int channel_open_reader(channel_t *c, channel_mode_t mode, int id) {
+	struct stat st;
+	char name[64];
+	int fd;
+	channel_name(name, sizeof(name), mode, id);
+	c->mode=mode;
+	c->fd=-1;
+	c->ring=NULL;
+	c->rx_len=c->rx_pos=c->rx_left=c->ended=0;
+	if(mode==CHANNEL_PIPE) {
+		if(mkfifo(name, 0666) == -1 && errno != EEXIST)
+			return -1;
+		c->fd=open(name, O_RDONLY);
+		return c->fd==-1?-1:0;
+	}
+	for(;;) {
+		fd=shm_open(name, O_RDWR, 0);
+		if(fd==-1 && errno!=ENOENT)
+			return -1;
+		if(fd!=-1) {
+			if(fstat(fd, &st) == -1) {
+				close(fd);
+				return -1;
+			}
+			if(st.st_size == sizeof(channel_ring_t))
+				break;
+			close(fd); // not sized yet
+		}
+		usleep(100000);
+	}
+	c->ring=mmap(NULL, sizeof(channel_ring_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(c->ring==MAP_FAILED)
+		return -1;
+	shm_unlink(name); // the mappings keep it alive
+	return 0;
+}
+
+// sends n payloads, blocking while the ring is full; -1 on failure, like write().
+// On the pipe they go in frames of up to CHANNEL_BATCH, one syscall each; on the ring
+// they are published together as far as they fit, with at most one wakeup
+static inline int channel_send_batch(channel_t *c, const int *payloads, int n) {
+	channel_ring_t *r=c->ring;
+	unsigned t, seq, room;
+	int i;
+	if(c->mode==CHANNEL_PIPE) {
+		for(i=0;i<n;i+=CHANNEL_BATCH)
+			if(frame_write(c->fd, FRAME_DATA, payloads+i, n-i<CHANNEL_BATCH?n-i:CHANNEL_BATCH) == -1)
+				return -1;
+		return 0;
+	}
+	t=atomic_load_explicit(&r->tail, memory_order_relaxed);
+	while(n>0) {
+		while((room=CHANNEL_SLOTS-(t-atomic_load(&r->head))) == 0) {
+			seq=atomic_load(&r->writer_wake);
+			atomic_store(&r->writer_waiting, 1);
+			if(t-atomic_load(&r->head) == CHANNEL_SLOTS)
+				channel_futex(&r->writer_wake, FUTEX_WAIT, seq);
+			atomic_store(&r->writer_waiting, 0);
+		}
+		for(i=0;i<n && i<(int)room;i++)
+			r->slot[(t+i)&(CHANNEL_SLOTS-1)]=payloads[i];
+		t+=i;
+		payloads+=i;
+		n-=i;
+		atomic_store(&r->tail, t);
+		if(atomic_load(&r->reader_waiting))
+			channel_wake(&r->reader_wake);
+	}
+	return 0;
+}
+
+static inline int channel_send(channel_t *c, int payload) {
+	return channel_send_batch(c, &payload, 1);
+}
+
+// sends as many of the n payloads as can go without blocking and returns how many went,
+// or -1 on failure. On the pipe, set to non-blocking by channel_nonblock, a frame is
+// never split since it fits PIPE_BUF: it goes whole or not at all
+static inline int channel_try_send_batch(channel_t *c, const int *payloads, int n) {
+	channel_ring_t *r=c->ring;
+	unsigned t, room;
+	int i, m;
+	if(c->mode==CHANNEL_PIPE) {
+		for(i=0;i<n;i+=m) {
+			m=n-i<CHANNEL_BATCH?n-i:CHANNEL_BATCH;
+			if(frame_write(c->fd, FRAME_DATA, payloads+i, m) == -1)
+				return errno==EAGAIN?i:-1;
+		}
+		return n;
+	}
+	t=atomic_load_explicit(&r->tail, memory_order_relaxed);
+	room=CHANNEL_SLOTS-(t-atomic_load(&r->head));
+	for(i=0;i<n && i<(int)room;i++)
+		r->slot[(t+i)&(CHANNEL_SLOTS-1)]=payloads[i];
+	if(i>0) {
+		atomic_store(&r->tail, t+i);
+		if(atomic_load(&r->reader_waiting))
+			channel_wake(&r->reader_wake);
+	}
+	// everything went: the slave need not signal room any more (see channel_want_room)
+	if(i==n && atomic_load_explicit(&r->writer_waiting, memory_order_relaxed))
+		atomic_store(&r->writer_waiting, 0);
+	return i;
+}
+
+// master side, ring: asks the slave to signal wake_fd when it takes a payload; returns 1
+// if there is room already, since the slave may have taken it before seeing the request
+static inline int channel_want_room(channel_t *c) {
+	if(c->mode==CHANNEL_PIPE)
+		return 0;
+	atomic_store(&c->ring->writer_waiting, 1);
+	return atomic_load(&c->ring->tail)-atomic_load(&c->ring->head) < CHANNEL_SLOTS;
+}
+
+// master side, ring: empties wake_fd once it was seen readable
+static inline void channel_room_seen(channel_t *c) {
+	uint64_t n;
+	if(c->mode!=CHANNEL_PIPE && read(c->wake_fd, &n, sizeof(n)) == -1 && errno!=EAGAIN)
+		perror("Error reading the channel's eventfd");
+}
+
+// master side: payloads sent and not taken by the slave yet; on the pipe, those in whole
+// frames still in the pipe, as far as the slave has not read them
+static inline long channel_outstanding(channel_t *c) {
+	int bytes=0;
+	if(c->mode!=CHANNEL_PIPE)
+		return atomic_load(&c->ring->tail)-atomic_load(&c->ring->head);
+	ioctl(c->fd, FIONREAD, &bytes);
+	return bytes/sizeof(int);
+}
+
+// the doorbell of a ring: the slave wakes writer_wake when it takes a payload while the
+// master waits for room, as for a blocked channel_send_batch, and each wakeup becomes a
+// write to wake_fd. Ends once the master closes the ring
+static inline void *channel_doorbell(void *arg) {
+	channel_t *c=arg;
+	channel_ring_t *r=c->ring;
+	unsigned seq=atomic_load(&r->writer_wake);
+	uint64_t one=1;
+	while(!atomic_load(&r->closed)) {
+		channel_futex(&r->writer_wake, FUTEX_WAIT, seq);
+		if(atomic_load(&r->writer_wake) != seq) {
+			seq=atomic_load(&r->writer_wake);
+			if(write(c->wake_fd, &one, sizeof(one)) == -1)
+				perror("Error writing the channel's eventfd");
+		}
+	}
+	return NULL;
+}
+
+// master side: makes sends non-blocking and returns the descriptor to watch for room,
+// -1 on failure. That is the pipe itself, writable once there is room, or for the ring
+// wake_fd, readable once the slave made room after channel_want_room. The slave cannot
+// open an eventfd of the master, so a thread of the master rings it (channel_doorbell)
+static inline int channel_nonblock(channel_t *c) {
+	if(c->mode==CHANNEL_PIPE) {
+		fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+		return c->fd;
+	}
+	c->wake_fd=eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+	if(c->wake_fd==-1)
+		return -1;
+	errno=pthread_create(&c->doorbell, NULL, channel_doorbell, c);
+	if(errno!=0) {
+		close(c->wake_fd);
+		c->wake_fd=-1;
+		return -1;
+	}
+	return c->wake_fd;
+}
+
+// streaming parser of the pipe: reads whatever is there, as much as fits, and returns
+// payloads from the frames that are complete and checked. Frames may arrive split or
+// several per read. A bad frame fails with EBADMSG
+static inline int frame_recv(channel_t *c, int *payload) {
+	frame_header_t h;
+	size_t avail;
+	int n;
+	for(;;) {
+		if(c->rx_left>0) {
+			memcpy(payload, c->rx+c->rx_pos, sizeof(int));
+			c->rx_pos+=sizeof(int);
+			c->rx_left--;
+			return 1;
+		}
+		if(c->ended)
+			return 0;
+		avail=c->rx_len-c->rx_pos;
+		if(avail>=sizeof(h)) {
+			memcpy(&h, c->rx+c->rx_pos, sizeof(h));
+			if(h.magic!=CHANNEL_MAGIC || h.count>CHANNEL_BATCH || (h.type!=FRAME_DATA && h.type!=FRAME_END)) {
+				errno=EBADMSG;
+				return -1;
+			}
+			if(avail>=sizeof(h)+h.count*sizeof(int)) {
+				if(frame_checksum(&h, c->rx+c->rx_pos+sizeof(h)) != h.sum) {
+					errno=EBADMSG;
+					return -1;
+				}
+				c->rx_pos+=sizeof(h);
+				c->rx_left=h.count;
+				c->ended=h.type==FRAME_END;
+				continue;
+			}
+		}
+		// the rest of a frame is still to come: keep the part we have and read more
+		memmove(c->rx, c->rx+c->rx_pos, avail);
+		c->rx_len=avail;
+		c->rx_pos=0;
+		n=read(c->fd, c->rx+c->rx_len, sizeof(c->rx)-c->rx_len);
+		if(n==-1 && errno==EINTR)
+			continue;
+		if(n==0 && c->rx_len>0) { // the master died in the middle of a frame
+			errno=EBADMSG;
+			return -1;
+		}
+		if(n<=0)
+			return n;
+		c->rx_len+=n;
+	}
+}
+
+// receives one payload, blocking while the ring is empty; returns 1, 0 once the master
+// closed the channel and every payload was taken, -1 on failure, like read()
+static inline int channel_recv(channel_t *c, int *payload) {
+	channel_ring_t *r=c->ring;
+	unsigned h, seq;
+	if(c->mode==CHANNEL_PIPE)
+		return frame_recv(c, payload);
+	h=atomic_load_explicit(&r->head, memory_order_relaxed);
+	while(atomic_load(&r->tail) == h) {
+		if(atomic_load(&r->closed) && atomic_load(&r->tail) == h)
+			return 0; // closed is set after the last payload is stored
+		seq=atomic_load(&r->reader_wake);
+		atomic_store(&r->reader_waiting, 1);
+		if(atomic_load(&r->tail) == h && !atomic_load(&r->closed))
+			channel_futex(&r->reader_wake, FUTEX_WAIT, seq);
+		atomic_store(&r->reader_waiting, 0);
+	}
+	*payload=r->slot[h&(CHANNEL_SLOTS-1)];
+	atomic_store(&r->head, h+1);
+	// the master is woken once half the ring is free, not for every payload taken, and
+	// only once per request
+	if(atomic_load(&r->writer_waiting) && atomic_load(&r->tail)-(h+1) <= CHANNEL_SLOTS/2 &&
+			atomic_exchange(&r->writer_waiting, 0))
+		channel_wake(&r->writer_wake);
+	return 1;
+}
+
+// either side; when the master closes after its last payload, the slave still gets the
+// ones in flight, then 0
+static inline void channel_close(channel_t *c, int master) {
+	if(c->mode==CHANNEL_PIPE) {
+		if(master) {
+			fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+			frame_write(c->fd, FRAME_END, NULL, 0);
+		}
+		close(c->fd);
+		return;
+	}
+	if(master) {
+		atomic_store(&c->ring->closed, 1);
+		channel_wake(&c->ring->reader_wake);
+		if(c->wake_fd!=-1) {
+			channel_wake(&c->ring->writer_wake); // lets the doorbell see closed
+			pthread_join(c->doorbell, NULL);
+			close(c->wake_fd);
+		}
+	}
+	munmap(c->ring, sizeof(channel_ring_t));
+}
+
+#endif
@@ -1,23 +1,99 @@
 
+#define _GNU_SOURCE // sched_getcpu, memfd_create
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <immintrin.h>
+#include "rng.h"
 
 // CONSTANTS AND MACROS
 // for readability
-#define N_THREADS 4 //15
+#define N_THREADS 4 // default number of workers (-w)
+#define MAX_THREADS 64 // max number of workers alive at once, and of threads in benchmark mode
 #define FOREVER for(;;)
-#define BUFFER_SIZE 30 // buffer size
+#define BUFFER_SIZE 30 // default buffer size
+#define MAX_BUFFER_SIZE (1 << 24) // max buffer size
 #define MAX_VSIZE 10 // max size of vectors (possible sizes: 3, 5, 10)
 #define MAX_ITERATIONS 200
 #define WAIT_LOOPS 10
 #define MIN_LOOPS 5
+#define MAX_BATCH 16 // max number of vectors moved by download_batch/upload_batch
+#define BENCH_ITERATIONS 10000 // default operations per thread in benchmark mode
+#define MAX_SHARDS 16 // max number of shards of the sharded engine
+#define SEED 42 // default seed of the random numbers
+#define CACHE_LINE 64
+#define RT_PRIORITY 10 // SCHED_FIFO priority of threads with k=3 in real-time mode; +1 for 5, +2 for 10
+#define RT_REPORT_SECONDS 5 // worst-case blocking is printed this often in real-time mode
+#define WATCHDOG_SKIPS 100 // calls returned by others while one waits that make it starved, see WATCHDOG
+#define WATCHDOG_REPORT 0 // on a stall the watchdog only reports (-A report)
+#define WATCHDOG_UNJAM 1
+#define WATCHDOG_CLOSE 2
+#ifndef METRICS
+#define METRICS 1 // -DMETRICS=0 compiles the metrics out
+#endif
+#define METRICS_SAMPLE 16 // one monitor call in this many per thread is timed, with its mutex hold, and reads the occupancy
+#define HIST_SUB 8 // histogram buckets per power of two, so a bucket is within 12.5% of its values
+#define HIST_BUCKETS (16+37*HIST_SUB) // exact below 16 ns, then up to 2^41 ns
 
-//define policies
-#define FVF 0
-#define SVF 1
-#define LVF 0
+// monitor_t keeps the groups of fields written by different threads on separate cache
+// lines; -DMONITOR_PACKED packs them as they used to be, for comparison
+#ifdef MONITOR_PACKED
+#define CACHE_ALIGNED
+#else
+#define CACHE_ALIGNED _Alignas(CACHE_LINE)
+#endif
+
+// logging: LOG(level, event, a, b) records an event of the calling thread. Levels above
+// LOG_LEVEL are compiled out (-DLOG_LEVEL=LOG_OFF removes them all), the others are
+// filtered at runtime by log_level (-l). Records go to a per-thread ring and a drain
+// thread writes them to the trace file, so no stdio runs inside the monitor
+#define LOG_OFF 0
+#define LOG_ERROR 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+#define LOG_RING_SIZE 4096 // records per thread ring, a power of two
+#define LOG_MAX_RINGS (MAX_THREADS+2) // threads that can log at once, see log_release
+#define LOG(level, event, a, b) do { \
+		if ((level) <= LOG_LEVEL && (level) <= log_level) \
+			log_event(level, event, a, b); \
+	} while (0)
+// a thread is about to wait in the monitor (EV_WAIT_DOWNLOAD or EV_WAIT_UPLOAD)
+#define LOG_WAIT(event, a) do { \
+		LOG(LOG_INFO, event, a, 0); \
+		metrics_waiting(); \
+	} while (0)
+
+// a thread about to sleep in the monitor spins first, see ADAPTIVE WAITING
+#ifndef SPIN_MAX_NS
+#define SPIN_MAX_NS 20000 // longest spin; 0 never spins
+#endif
+#define SPIN_MIN_NS 250 // shortest spin, kept while recent waits were longer than SPIN_MAX_NS
+
+// upload policies are chosen at startup (-p svf|lvf|fvf|aging), see policies[]
+// under the aging policy a waiting size class that was passed over AGING_LIMIT times goes first
+#define AGING_LIMIT 4
 
 // for simplicity, vectors are always size 10 and matrices are 10x10
 // then, part of the space will be unused, no big deal
@@ -31,6 +107,12 @@ typedef struct matrix_t {
 	int data[MAX_VSIZE][MAX_VSIZE];
 } matrix_t;
 
+// a matrix of -1 and +1 with one bit per entry: bit j of sign[i] is set if entry (i,j) is -1
+typedef struct packed_matrix_t {
+	unsigned char n, m;
+	unsigned short sign[MAX_VSIZE];
+} packed_matrix_t;
+
 // DEFINITIONS OF NEW DATA TYPES
 // for readability
 typedef char thread_name_t[10];
@@ -38,48 +120,419 @@ typedef char thread_name_t[10];
 // acronyms for policies
 typedef enum boolean {FALSE, TRUE} boolean;
 
+// a worker of the thread loop, see EXECUTOR
+typedef struct worker_t {
+    pthread_t tid;
+    thread_name_t name; // "t<id>", id being its index in workers[]
+    int k, o; // shape: downloads vectors up to k and uploads vectors of size o; 0 is random
+    atomic_int leave; // set to stop the worker after its current step
+    atomic_int finished; // set by the worker on its way out
+    boolean alive; // started and not joined yet
+    struct log_ring_t *ring; // log ring and metrics slot of its last run, taken over by the
+    struct metrics_t *slot;  // next worker with the same id so that the id keeps its ring
+} worker_t;
+
+// a record in the buffer: the size slot followed by the data, like a vector_t, split in
+// two where the ring wraps
+typedef struct span_t {
+    int *part[2];
+    int len[2]; // slots in each part; len[1] is 0 unless the record wraps
+} span_t;
+
+// wait queue used by the lock-free engine: threads sleep on seq (a futex word)
+// and wakers bump it, so a wakeup between the last check and the sleep is not lost.
+// One per line, so sleepers of a class do not slow down the others
+typedef struct waitq_t {
+    CACHE_ALIGNED atomic_uint seq;
+    atomic_int waiters; // threads sleeping (or about to sleep) on seq
+} waitq_t;
+
+// events recorded by LOG, see log_format[] for the meaning of a and b
+typedef enum log_event_t {EV_UPLOAD, EV_DOWNLOAD, EV_WAIT_DOWNLOAD, EV_WAIT_UPLOAD} log_event_t;
+
+// a trace record; binary traces are a sequence of these
+typedef struct log_record_t {
+    uint64_t ns; // CLOCK_MONOTONIC
+    uint32_t thread; // index of the ring of the thread
+    uint16_t level, event;
+    int32_t a, b;
+} log_record_t;
+
+// written by its thread only, read by the drain thread only
+typedef struct log_ring_t {
+    _Alignas(64) atomic_uint head; // next record to write
+    _Alignas(64) atomic_uint tail; // next record to drain
+    atomic_ulong dropped; // records lost because the ring was full
+    log_record_t rec[LOG_RING_SIZE];
+} log_ring_t;
+
+// metrics of a thread, see METRICS. Written by their thread only, read by the metrics
+// thread; op is 0 for downloads, 1 for uploads, then the size class (of k for downloads)
+typedef struct metrics_t {
+    _Alignas(64) atomic_ulong calls[2][3]; // monitor calls
+    atomic_ulong vectors[2][3]; // vectors moved
+    atomic_ulong waits[2][3]; // calls that waited
+    atomic_ulong spurious[2][3]; // wakeups after which the call had to wait again
+    atomic_ulong blocked_ns[2][3]; // time from the first wait to the end of calls that waited
+    atomic_ulong spins[2][3], spin_hits[2][3]; // waits that spun, and ended spinning
+    atomic_ulong holds, hold_ns, hold_max_ns; // sampled holds of the monitor mutex
+    atomic_ulong occupancy_n, occupancy_sum, occupancy_max; // sampled slots in use
+    atomic_ulong max_ns[2]; // longest timed call or wait
+    atomic_ulong hist[2][HIST_BUCKETS]; // latency of timed calls, see hist_bucket
+    unsigned long sample[2]; // calls so far, to pick the timed ones
+} metrics_t;
+
+// FVF uploader waiting in the mutex engine, on the thread's stack
+typedef struct fvf_node_t {
+    pthread_cond_t cond;
+    struct fvf_node_t *next;
+} fvf_node_t;
+
+// wait node of a thread blocked in the handoff engine, on the thread's stack
+typedef struct ho_node_t {
+    vector_t *V; // vector to fill (download) or to copy to the buffer (upload)
+    unsigned long arrival; // arrival order of uploaders, for FVF
+    atomic_uint state; // HO_WAITING, HO_SLEEPING, HO_DONE or HO_CLOSED; futex word
+    struct ho_node_t *next;
+} ho_node_t;
+
+// FIFO of wait nodes
+typedef struct ho_queue_t {
+    ho_node_t *head, *tail;
+    int n;
+} ho_queue_t;
+
+// a ring of the sharded engine, holding vectors of one size class without the size slot
+typedef struct sh_ring_t {
+    _Alignas(64) pthread_mutex_t mutex;
+    int *slots;
+    int n_records; // records the ring can hold, enough for the whole buffer
+    int in, out; // record indexes
+    atomic_int count; // records stored; read without the mutex to skip empty rings
+} sh_ring_t;
+
+struct monitor_t;
+
+// a buffer engine implements the monitor API on top of the shared buffer
+typedef struct engine_t {
+    const char *name;
+    boolean (*download)(struct monitor_t *mon, int k, vector_t *V);
+    boolean (*upload)(struct monitor_t *mon, vector_t *V);
+    int (*download_batch)(struct monitor_t *mon, int k, vector_t *V, int n);
+    boolean (*upload_batch)(struct monitor_t *mon, vector_t *V, int n);
+    // zero-copy access, NULL if the engine has none (see download_begin)
+    boolean (*download_begin)(struct monitor_t *mon, int k, span_t *S);
+    void (*download_end)(struct monitor_t *mon, span_t *S);
+    boolean (*upload_begin)(struct monitor_t *mon, int size, span_t *S, boolean wait);
+    void (*upload_commit)(struct monitor_t *mon, span_t *S);
+    // free slots, read without synchronization (metrics)
+    int (*free_slots)(struct monitor_t *mon);
+    // writes the records in the buffer and the waiting threads to f, read without
+    // synchronization (watchdog)
+    void (*snapshot)(struct monitor_t *mon, FILE *f);
+    // like download and upload, but return FALSE at once where those would wait: no
+    // vector fits k, or V does not fit or other uploaders are queued (watchdog)
+    boolean (*download_nowait)(struct monitor_t *mon, int k, vector_t *V);
+    boolean (*upload_nowait)(struct monitor_t *mon, vector_t *V);
+} engine_t;
+
+// an upload policy decides which waiting uploader goes first; each engine has its own hooks
+typedef struct policy_t {
+    const char *name;
+    // mutex engine: called with the mutex held, returns when V fits and it is V's turn,
+    // or when the monitor is closed
+    void (*wait_upload)(struct monitor_t *mon, vector_t *V);
+    // mutex engine: called with the mutex held after a download freed some space
+    void (*signal_upload)(struct monitor_t *mon);
+    // lock-free engine: returns the position of the slots reserved for V, -1 if the monitor is closed
+    int_fast64_t (*lf_reserve)(struct monitor_t *mon, vector_t *V);
+    // lock-free engine: called after a download freed some space
+    void (*lf_wake_upload)(struct monitor_t *mon);
+    // handoff engine: mutex held, returns the size class of the queued uploader to serve
+    // next, -1 if none should be served now
+    int (*ho_pick_upload)(struct monitor_t *mon);
+} policy_t;
+
 // monitor also defined as a new data types
+// fields are grouped by who writes them, each group starting on its own cache line, so
+// that threads working on one part of the monitor do not invalidate the lines another
+// part is read from: what is only read after monitor_init, the mutex engine state, the
+// condition variables (a waiter touches its own after releasing the mutex), the upload
+// and download sides of the lock-free engine and every wait queue. Build with
+// -DMONITOR_PACKED to get the same fields packed as before, to compare the two
 typedef struct monitor_t {
-    // shared data to manage
-    int buffer[BUFFER_SIZE];
-    int in, out;
-    // the following integers are for better readability
-    int next_size; // the size of the next vector; 0 if empty buffer
-    int capacity; // the size of the longest V that can be uploaded to the buffer
+    // read-mostly: set by monitor_init
+    // the ring has mask+1 slots, a power of two of at least size. When mirrored, the same
+    // pages are mapped again right after it, so a record is contiguous even where the
+    // ring wraps (see ring_map)
+    int *buffer;
+    int size; // buffer size, BUFFER_SIZE unless set otherwise
+    int mask; // slots are indexed with & mask
+    boolean mirrored;
+    size_t map_len; // bytes mapped or allocated for buffer
+    unsigned char *done; // set on the size slot of a record committed or released out of order
+    atomic_uint_fast64_t *lf_tag; // one per slot, see lf_in
+    int sh_shards;
+
+    // engine serving download/upload and upload policy
+    const engine_t *engine;
+    const policy_t *policy;
+
+    // set by monitor_close: blocked and later calls return at once
+    atomic_int closed;
 
     // synchronization variables and states common to all policies
-    pthread_mutex_t mutex;
-    pthread_cond_t can_download3;
-    pthread_cond_t can_download5;
-    pthread_cond_t can_download10;
+    CACHE_ALIGNED pthread_mutex_t mutex;
+    // shared data to manage, under mutex
+    // records go in at in and are freed from out; between them, in this order, are the
+    // records taken by a downloader and not yet released, the ones visible to downloaders
+    // (from claim) and the ones reserved by an uploader and not yet committed (from pub).
+    // A record is freed or published only when the ones before it are, see ring_commit
+    int in, out, claim, pub;
+    int claimed, avail, reserved; // slots in each of the three parts
+    // the following integers are for better readability
+    int next_size; // the size of the next vector visible to downloaders; 0 if none
+    int capacity; // the size of the longest V that can be uploaded to the buffer
     int n_d3, n_d5, n_d10; // number of threads in the corresponding condition variable (dowload)
-
-	// synchronization variables and states for SVF and for LVF
-    pthread_cond_t can_upload3;
-    pthread_cond_t can_upload5;
-    pthread_cond_t can_upload10;
     int n_u3, n_u5, n_u10; // number of threads in the corresponding condition variable (upload)
+    int n_u; // FVF: uploaders queued
+    fvf_node_t *fvf_head, *fvf_tail; // FVF: uploaders in arrival order, the head goes next
+
+    // state for the aging policy: times each size class was passed over while waiting
+    int age[3];
+
+    // state for the handoff engine, protected by mutex; the aging policy uses age
+    ho_queue_t ho_download[3]; // per size class of k
+    ho_queue_t ho_upload[3]; // per size class of the vector
+    unsigned long ho_arrival; // uploaders queued so far
+
+    // bumped under mutex by every change to the ring and by monitor_close; threads spin
+    // on it before sleeping on a condition variable, see monitor_wait
+    CACHE_ALIGNED atomic_uint changes;
 
-    // synchronization variables and states for FVF
-    pthread_cond_t can_upload[N_THREADS];
-    int index_in, index_served, n_u; // index of the next thread to upload
+    CACHE_ALIGNED pthread_cond_t can_download3;
+    CACHE_ALIGNED pthread_cond_t can_download5;
+    CACHE_ALIGNED pthread_cond_t can_download10;
+
+	// synchronization variables for SVF, LVF and aging
+    CACHE_ALIGNED pthread_cond_t can_upload3;
+    CACHE_ALIGNED pthread_cond_t can_upload5;
+    CACHE_ALIGNED pthread_cond_t can_upload10;
+
+    // state for the lock-free engine
+    // lf_in and lf_out are absolute positions (never wrapped); a record is published by
+    // storing its tag (position<<8 | size) in the slot of its header, and claimed by
+    // swapping the tag to 0. Uploaders move lf_in, downloaders lf_out
+    CACHE_ALIGNED atomic_uint_fast64_t lf_in;
+    CACHE_ALIGNED atomic_uint_fast64_t lf_out;
+    CACHE_ALIGNED atomic_uint lf_ticket, lf_serving; // FVF uploaders
+    atomic_int lf_age[3]; // aging policy
+    waitq_t lf_download[3]; // per size class of k
+    waitq_t lf_upload[3]; // per size class of the output vector (SVF, LVF and aging)
+    waitq_t lf_fvf; // FVF uploaders, served in ticket order
+
+    // state for the sharded engine: every shard has a ring per size class
+    sh_ring_t sh_ring[MAX_SHARDS][3];
+    CACHE_ALIGNED atomic_int sh_capacity; // free slots, shared by all rings as if they were one buffer
+    waitq_t sh_download[3]; // per size class of k
+    waitq_t sh_upload[3]; // per size class of the vector
 
 } monitor_t;
 
+#ifndef MONITOR_PACKED
+// a group sharing a line with another would undo the layout
+#define APART(a, b) (offsetof(monitor_t, a) / CACHE_LINE != offsetof(monitor_t, b) / CACHE_LINE)
+_Static_assert(sizeof(waitq_t) == CACHE_LINE, "a wait queue takes a line");
+_Static_assert(APART(closed, mutex), "read-mostly fields share a line with the mutex");
+_Static_assert(APART(ho_arrival, changes) && APART(changes, can_download3), "the change counter shares a line");
+_Static_assert(APART(can_download3, can_download5) && APART(can_upload5, can_upload10), "condition variables share a line");
+_Static_assert(APART(can_upload10, lf_in), "condition variables share a line with the lock-free engine");
+_Static_assert(APART(lf_in, lf_out) && APART(lf_out, lf_ticket), "lock-free uploaders and downloaders share a line");
+_Static_assert(APART(lf_age[2], lf_download[0]), "lock-free counters share a line with a wait queue");
+_Static_assert(APART(sh_ring[MAX_SHARDS-1][2].count, sh_capacity), "sharded rings share a line with the capacity");
+_Static_assert(offsetof(monitor_t, lf_in) % CACHE_LINE == 0 && offsetof(monitor_t, sh_capacity) % CACHE_LINE == 0, "groups start a line");
+#undef APART
+#endif
+
 // GLOBAL VARIABLES
 // the monitor should be defined as a global variable
 monitor_t mon;
 int next_value=1;
+int log_level=LOG_DEBUG; // runtime log level (-l), has no effect above LOG_LEVEL
+log_ring_t log_rings[LOG_MAX_RINGS];
+atomic_int log_n_rings; // rings handed out so far
+_Thread_local log_ring_t *log_ring; // ring of this thread, taken on its first record
+log_ring_t *log_free_rings[LOG_MAX_RINGS]; // rings given back by threads that exited
+int log_n_free;
+pthread_mutex_t log_free_lock=PTHREAD_MUTEX_INITIALIZER;
+atomic_ulong log_no_ring; // records lost because every ring was taken
+FILE *log_file; // trace file (-o), stdout by default
+boolean log_binary=FALSE; // write log_record_t instead of text (-f binary)
+atomic_int log_running;
+pthread_t log_tid;
+_Thread_local unsigned long n_wakeups; // times this thread returned from a wait in the monitor
+_Thread_local unsigned long n_spins, n_spin_hits; // waits that spun first, and the ones that ended spinning
+_Thread_local long spin_mean_ticks[2]; // recent waits of this thread (download, upload), see spin_learn
+long spin_min_ticks, spin_max_ticks; // spin budget bounds in TSC ticks, 0 on a single CPU
+double metrics_ns_per_tick; // TSC rate, see tsc_calibrate
+uint64_t seed=SEED; // random numbers of the run (-R), split into one stream per thread
+_Thread_local rng_t rng; // this thread's stream, see rng.h
+long bench_iterations=BENCH_ITERATIONS; // operations per thread in benchmark mode (-n)
+int batch=1; // vectors per monitor call in the thread loop (-b)
+boolean packed=TRUE; // threads multiply with packed matrices (-m packed) or int ones (-m int)
+boolean zerocopy=FALSE; // threads multiply in place in the buffer (-z), see zerocopy_step
+int shards=1; // shards of the sharded engine (-r)
+boolean rt=FALSE; // real-time mode (-F), see REAL-TIME MODE
+atomic_long rt_worst_ns[2][3]; // real-time mode: longest download/upload call so far, per size class
+boolean metrics_on=FALSE; // set outside benchmark mode, which measures on its own
+metrics_t metrics_slots[LOG_MAX_RINGS];
+atomic_int metrics_n_slots; // slots handed out so far
+_Thread_local metrics_t *metrics_self; // slot of this thread, taken on its first call
+_Thread_local long hold_start_ns; // sampled mutex hold in progress, 0 if none
+_Thread_local long wait_start_ns; // first wait of the current call, 0 if none
+_Thread_local boolean metrics_timed; // the current call is timed
+_Thread_local unsigned long hold_wakeups; // n_wakeups when it started
+worker_t workers[MAX_THREADS]; // indexed by worker id, see EXECUTOR
+boolean track_calls=FALSE; // workers keep their call in progress (-F or -D), see CALLS IN PROGRESS
+int watchdog_ms=0; // stall and starvation threshold of the watchdog (-D), 0 if there is none
+int watchdog_action=WATCHDOG_REPORT; // what the watchdog does on a stall (-A)
+const char *watchdog_actions[] = {"report", "unjam", "close"}; // indexed by WATCHDOG_REPORT...
 
 //  MONITOR API
-void download(monitor_t *mon, int k, vector_t *V);
-void upload(monitor_t *mon, vector_t *V);
-void monitor_init(monitor_t *mon);
+// download and upload return FALSE, and download_batch 0, once the monitor is closed
+boolean download(monitor_t *mon, int k, vector_t *V);
+boolean upload(monitor_t *mon, vector_t *V);
+int download_batch(monitor_t *mon, int k, vector_t *V, int n);
+boolean upload_batch(monitor_t *mon, vector_t *V, int n);
+boolean download_begin(monitor_t *mon, int k, span_t *S);
+void download_end(monitor_t *mon, span_t *S);
+boolean upload_begin(monitor_t *mon, int size, span_t *S, boolean wait);
+void upload_commit(monitor_t *mon, span_t *S);
+vector_t *span_vector(span_t *S);
+void monitor_init(monitor_t *mon, const engine_t *engine, const policy_t *policy, int size);
+void monitor_close(monitor_t *mon);
 void monitor_destroy(monitor_t *mon);
 
+// ENGINES
+boolean mutex_download(monitor_t *mon, int k, vector_t *V);
+boolean mutex_upload(monitor_t *mon, vector_t *V);
+int mutex_download_batch(monitor_t *mon, int k, vector_t *V, int n);
+boolean mutex_upload_batch(monitor_t *mon, vector_t *V, int n);
+boolean mutex_download_begin(monitor_t *mon, int k, span_t *S);
+void mutex_download_end(monitor_t *mon, span_t *S);
+boolean mutex_upload_begin(monitor_t *mon, int size, span_t *S, boolean wait);
+void mutex_upload_commit(monitor_t *mon, span_t *S);
+boolean lf_download(monitor_t *mon, int k, vector_t *V);
+boolean lf_upload(monitor_t *mon, vector_t *V);
+int lf_download_batch(monitor_t *mon, int k, vector_t *V, int n);
+boolean lf_upload_batch(monitor_t *mon, vector_t *V, int n);
+boolean ho_download(monitor_t *mon, int k, vector_t *V);
+boolean ho_upload(monitor_t *mon, vector_t *V);
+int ho_download_batch(monitor_t *mon, int k, vector_t *V, int n);
+boolean ho_upload_batch(monitor_t *mon, vector_t *V, int n);
+boolean sh_download(monitor_t *mon, int k, vector_t *V);
+boolean sh_upload(monitor_t *mon, vector_t *V);
+int sh_download_batch(monitor_t *mon, int k, vector_t *V, int n);
+boolean sh_upload_batch(monitor_t *mon, vector_t *V, int n);
+int mutex_free_slots(monitor_t *mon);
+int lf_capacity(monitor_t *mon);
+int sh_free_slots(monitor_t *mon);
+void mutex_snapshot(monitor_t *mon, FILE *f);
+void lf_snapshot(monitor_t *mon, FILE *f);
+void ho_snapshot(monitor_t *mon, FILE *f);
+void sh_snapshot(monitor_t *mon, FILE *f);
+boolean mutex_download_nowait(monitor_t *mon, int k, vector_t *V);
+boolean mutex_upload_nowait(monitor_t *mon, vector_t *V);
+boolean lf_download_nowait(monitor_t *mon, int k, vector_t *V);
+boolean lf_upload_nowait(monitor_t *mon, vector_t *V);
+boolean ho_download_nowait(monitor_t *mon, int k, vector_t *V);
+boolean ho_upload_nowait(monitor_t *mon, vector_t *V);
+boolean sh_download_nowait(monitor_t *mon, int k, vector_t *V);
+boolean sh_upload_nowait(monitor_t *mon, vector_t *V);
+
+const engine_t engines[] = {
+    {"mutex", mutex_download, mutex_upload, mutex_download_batch, mutex_upload_batch,
+        mutex_download_begin, mutex_download_end, mutex_upload_begin, mutex_upload_commit, mutex_free_slots, mutex_snapshot,
+        mutex_download_nowait, mutex_upload_nowait},
+    {"lockfree", lf_download, lf_upload, lf_download_batch, lf_upload_batch, NULL, NULL, NULL, NULL, lf_capacity, lf_snapshot,
+        lf_download_nowait, lf_upload_nowait},
+    {"handoff", ho_download, ho_upload, ho_download_batch, ho_upload_batch, NULL, NULL, NULL, NULL, mutex_free_slots, ho_snapshot,
+        ho_download_nowait, ho_upload_nowait},
+    {"sharded", sh_download, sh_upload, sh_download_batch, sh_upload_batch, NULL, NULL, NULL, NULL, sh_free_slots, sh_snapshot,
+        sh_download_nowait, sh_upload_nowait},
+};
+#define N_ENGINES (int)(sizeof(engines)/sizeof(engines[0]))
+
+// UPLOAD POLICIES
+void class_wait_upload(monitor_t *mon, vector_t *V);
+void fvf_wait_upload(monitor_t *mon, vector_t *V);
+void svf_signal_upload(monitor_t *mon);
+void lvf_signal_upload(monitor_t *mon);
+void fvf_signal_upload(monitor_t *mon);
+void aging_signal_upload(monitor_t *mon);
+int_fast64_t lf_class_reserve(monitor_t *mon, vector_t *V);
+int_fast64_t lf_fvf_reserve(monitor_t *mon, vector_t *V);
+void lf_svf_wake_upload(monitor_t *mon);
+void lf_lvf_wake_upload(monitor_t *mon);
+void lf_fvf_wake_upload(monitor_t *mon);
+void lf_aging_wake_upload(monitor_t *mon);
+int ho_svf_pick_upload(monitor_t *mon);
+int ho_lvf_pick_upload(monitor_t *mon);
+int ho_fvf_pick_upload(monitor_t *mon);
+int ho_aging_pick_upload(monitor_t *mon);
+
+const policy_t policies[] = {
+    {"svf", class_wait_upload, svf_signal_upload, lf_class_reserve, lf_svf_wake_upload, ho_svf_pick_upload},
+    {"lvf", class_wait_upload, lvf_signal_upload, lf_class_reserve, lf_lvf_wake_upload, ho_lvf_pick_upload},
+    {"fvf", fvf_wait_upload, fvf_signal_upload, lf_fvf_reserve, lf_fvf_wake_upload, ho_fvf_pick_upload},
+    {"aging", class_wait_upload, aging_signal_upload, lf_class_reserve, lf_aging_wake_upload, ho_aging_pick_upload},
+};
+#define N_POLICIES (int)(sizeof(policies)/sizeof(policies[0]))
+
 // OTHER FUNCTION DECLARATIONS
 // functions corresponding to thread entry points
 void *thread(void *arg);
+int executor_start(int n, const char *shapes, const char *config);
+void executor_run(void);
+void rt_init(void);
+void rt_thread_attr(pthread_attr_t *attr, int i);
+void call_thread_start(int i, int k);
+void call_thread_stop(void);
+void call_enter(int op, int size);
+void call_leave(void);
+void rt_report_once(void);
+void watchdog_start(void);
+boolean zerocopy_step(monitor_t *mon, int k, matrix_t *M, packed_matrix_t *P);
+
+// metrics
+typedef struct metrics_call_t {
+    long start_ns; // 0 if the call is not timed
+    unsigned long wakeups, spins, spin_hits;
+} metrics_call_t;
+void metrics_waiting(void);
+void metrics_begin(metrics_call_t *c, int op);
+void metrics_end(monitor_t *mon, metrics_call_t *c, int op, int size, int n);
+void monitor_lock(monitor_t *mon);
+void monitor_unlock(monitor_t *mon);
+void metrics_start(const char *path);
+long elapsed_ns(struct timespec *a, struct timespec *b);
+void tsc_calibrate(void);
+
+// adaptive waiting
+void spin_init(void);
+long futex(atomic_uint *uaddr, int op, unsigned val);
+
+// logging
+void log_event(int level, int event, int a, int b);
+void log_release(void);
+void log_start(const char *path);
+void log_stop(void);
+
+// kernel self-test
+long kernels_selftest(void);
+
+// benchmark mode
+void bench_main(char *engine_list, char *policy_list, char *thread_list, char *size_list, char *mix_list);
 
 // spend_some_time could be useful to waste an unknown amount of CPU cycles, up to a given top 
 double spend_some_time(int);
@@ -101,50 +554,111 @@ int size_of(vector_t *V) {
 	return V->size+1;
 }
 
+// index of the size class of a vector (or of a max size k)
+int size_class(int size) {
+	return size == 3 ? 0 : (size == 5 ? 1 : 2);
+}
+
+const int class_size[3] = {3, 5, 10};
+
+// the n slots from idx, split where the ring wraps unless it is mirrored
+void ring_span(monitor_t *mon, int idx, int n, span_t *S) {
+	S->part[0]=&mon->buffer[idx];
+	S->len[0]=mon->mirrored || mon->mask+1-idx>=n?n:mon->mask+1-idx;
+	S->part[1]=mon->buffer;
+	S->len[1]=n-S->len[0];
+}
+
+// the mutex holder changed the ring: spinners in monitor_wait go and check their condition
+static inline void ring_changed(monitor_t *mon) {
+	atomic_store_explicit(&mon->changes,atomic_load_explicit(&mon->changes,memory_order_relaxed)+1,memory_order_release);
+}
+
+// reserves room for a vector of the given size after the last record and writes its size
+// slot; assumes that there is enough capacity
+void ring_reserve(monitor_t *mon, int size, span_t *S) {
+	ring_span(mon,mon->in,size+1,S);
+	mon->buffer[mon->in]=size;
+	mon->done[mon->in]=FALSE;
+	mon->in=(mon->in+size+1)&mon->mask;
+	mon->capacity-=size+1;
+	mon->reserved+=size+1;
+}
+
+// the record in S is written; publishes it with every record after it that is committed
+// as well, as long as no earlier record is still being written
+void ring_commit(monitor_t *mon, span_t *S) {
+	int n;
+	mon->done[S->part[0]-mon->buffer]=TRUE;
+	while(mon->reserved>0 && mon->done[mon->pub]) {
+		n=mon->buffer[mon->pub]+1;
+		mon->done[mon->pub]=FALSE;
+		mon->pub=(mon->pub+n)&mon->mask;
+		mon->reserved-=n;
+		mon->avail+=n;
+	}
+	mon->next_size=mon->avail>0?mon->buffer[mon->claim]:0;
+	ring_changed(mon);
+	LOG(LOG_DEBUG, EV_UPLOAD, S->part[0][0], 0);
+}
+
+// takes the next visible record; assumes that there is one
+void ring_claim(monitor_t *mon, span_t *S) {
+	int n=mon->buffer[mon->claim]+1;
+	ring_span(mon,mon->claim,n,S);
+	mon->claim=(mon->claim+n)&mon->mask;
+	mon->avail-=n;
+	mon->claimed+=n;
+	mon->next_size=mon->avail>0?mon->buffer[mon->claim]:0;
+}
+
+// the record in S was read; frees it with every record after it that is released as
+// well, as long as no earlier record is still being read
+void ring_release(monitor_t *mon, span_t *S) {
+	int n;
+	mon->done[S->part[0]-mon->buffer]=TRUE;
+	while(mon->claimed>0 && mon->done[mon->out]) {
+		n=mon->buffer[mon->out]+1;
+		mon->done[mon->out]=FALSE;
+		mon->out=(mon->out+n)&mon->mask;
+		mon->claimed-=n;
+		mon->capacity+=n;
+	}
+	ring_changed(mon);
+	LOG(LOG_DEBUG, EV_DOWNLOAD, S->part[0][0], 0);
+}
+
+// copies between a vector and a record; a vector_t is laid out like a record
+void span_read(span_t *S, vector_t *V) {
+	memcpy(&V->size,S->part[0],S->len[0]*sizeof(int));
+	memcpy(&V->size+S->len[0],S->part[1],S->len[1]*sizeof(int));
+}
+
+void span_write(span_t *S, vector_t *V) {
+	memcpy(S->part[0],&V->size,S->len[0]*sizeof(int));
+	memcpy(S->part[1],&V->size+S->len[0],S->len[1]*sizeof(int));
+}
+
 // puts a vector in the buffer; assumes that there is enough capacity
 void to_buffer(monitor_t *mon, vector_t *V) {
-	int i;
-	// if buffer is empty, set next_size to size of V's data
-	if(mon->next_size==0) 
-		mon->next_size=V->size;
-	// subtract from the buffer's capacity the size of V
-	mon->capacity-=size_of(V);
-	// first slot is size of V's data
-	mon->buffer[mon->in]=V->size;
-	// then copy each value to buffer
-	for(i=0;i<V->size;i++) {
-		mon->in=(mon->in+1)%BUFFER_SIZE;
-		mon->buffer[mon->in]=V->data[i];
-	}
-	// set in to next empty slot in buffer
-	mon->in=(mon->in+1)%BUFFER_SIZE;
-	printf("produced V_%d\n", V->size);
+	span_t S;
+	ring_reserve(mon,V->size,&S);
+	span_write(&S,V);
+	ring_commit(mon,&S);
 }
 
 // takes a vector from the buffer; assumes that the buffer is not empty
 void from_buffer(monitor_t *mon, vector_t *V) {
-	int i;
-	// initialize size with first integer to be read from buffer
-	V->size=mon->buffer[mon->out];
-	// copy one by one all values from buffer to V
-	for(i=0;i<V->size;i++) {
-		mon->out=(mon->out+1)%BUFFER_SIZE;
-		V->data[i]=mon->buffer[mon->out];
-	}
-	// set out to next position in buffer
-	mon->out=(mon->out+1)%BUFFER_SIZE;
-	// increase the buffer's capacity by the size of V
-	mon->capacity+=size_of(V);
-	// if the buffer is empty, set next_size to 0
-	if(mon->capacity==BUFFER_SIZE)
-		mon->next_size=0;
-	printf("downloadd V_%d\n", V->size);
+	span_t S;
+	ring_claim(mon,&S);
+	span_read(&S,V);
+	ring_release(mon,&S);
 }
 
 // generate a random vector size
 int rand_size() {
 	int r;
-	r = rand()%3;
+	r = rng_below(&rng,3);
 	if(r==0) return 3;
 	else if(r==1) return 5;
 	else return 10;
@@ -165,15 +679,21 @@ void init_matrix(matrix_t *M, int n, int m) {
 	int i,j;
 	M->n=n;
 	M->m=m;
-	for(i=0;i<m;i++) {
-		for(j=0;j<n;j++)
-			M->data[i][j]=rand()%2?-1:1;
-		while(j++<MAX_VSIZE)
-			M->data[i][j]=0;
-	}
-	while(i++<MAX_VSIZE) {
+	for(i=0;i<MAX_VSIZE;i++)
 		for(j=0;j<MAX_VSIZE;j++)
-			M->data[i][j]=0;
+			M->data[i][j]=(i<m && j<n)?(rng_below(&rng,2)?-1:1):0;
+}
+
+// packs a matrix built by init_matrix
+void pack_matrix(packed_matrix_t *P, matrix_t *M) {
+	int i,j;
+	P->n=M->n;
+	P->m=M->m;
+	for(i=0;i<MAX_VSIZE;i++) {
+		P->sign[i]=0;
+		for(j=0;i<M->m && j<M->n;j++)
+			if(M->data[i][j]<0)
+				P->sign[i]|=1<<j;
 	}
 }
 
@@ -215,13 +735,508 @@ void multiply(matrix_t *M, vector_t *Vin, vector_t *Vout) {
 			Vout->data[i]=(int)(Vout->data[i]/max);
 }
 
+// MULTIPLY KERNELS
+// multiply() specialized for each of the nine m x k shapes, with scalar, SSE4.1 and AVX2
+// versions; the max is taken while computing the products, and the division by max/2 uses
+// a precomputed reciprocal (Granlund-Montgomery): for d>0, l=ceil(log2 d),
+// magic=floor(2^32*(2^l-d)/d)+1 and t=(a*magic)>>32, a/d == (t+((a-t)>>min(l,1)))>>max(l-1,0)
+// for every unsigned 32 bit a, so results are the same as with the integer division
+
+typedef struct divisor_t {
+	uint32_t magic;
+	int sh1, sh2;
+} divisor_t;
+
+#define DIVISOR_TABLE 1024 // divisors up to this are precomputed at startup
+divisor_t divisors[DIVISOR_TABLE];
+
+void divisor_init(divisor_t *D, uint32_t d) {
+	int l=0;
+	while(((uint64_t)1<<l)<d)
+		l++;
+	D->magic=(uint32_t)(((((uint64_t)1<<l)-d)<<32)/d+1);
+	D->sh1=l<1?l:1;
+	D->sh2=l>1?l-1:0;
+}
+
+static inline divisor_t get_divisor(int d) {
+	divisor_t D;
+	if(d<DIVISOR_TABLE)
+		return divisors[d];
+	divisor_init(&D,d);
+	return D;
+}
+
+// x/d with C's truncation, using the reciprocal of d
+static inline int divide(int x, const divisor_t *D) {
+	uint32_t a=x<0?0u-(uint32_t)x:(uint32_t)x;
+	uint32_t t=(uint32_t)(((uint64_t)a*D->magic)>>32);
+	uint32_t q=(t+((a-t)>>D->sh1))>>D->sh2;
+	return (int)(x<0?0u-q:q);
+}
+
+typedef void (*multiply_fn)(matrix_t *M, vector_t *Vin, vector_t *Vout);
+
+// scalar kernel; m and n are constants in each specialization, so the loops are unrolled
+static inline __attribute__((always_inline))
+void scalar_kernel(matrix_t *M, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	int i,j,max=0,acc;
+	divisor_t D;
+	Vout->size=m;
+	#pragma GCC unroll 16
+	for(i=0;i<m;i++) {
+		acc=0;
+		#pragma GCC unroll 16
+		for(j=0;j<n;j++)
+			acc+=M->data[i][j]*Vin->data[j];
+		Vout->data[i]=acc;
+		if(acc>max)
+			max=acc;
+	}
+	if(max/2) {
+		D=get_divisor(max/2);
+		#pragma GCC unroll 16
+		for(i=0;i<m;i++)
+			Vout->data[i]=divide(Vout->data[i],&D);
+	}
+}
+
+// lanes [0,n) of all ones
+static const int lane_mask[32]={-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1};
+#define LANE_MASK(n) (lane_mask+16-(n)) // n<=16 leading ones, then zeros
+
+// kernels store exactly m results, so that Vout can be a record in the buffer (see span_t)
+// stores lanes [0,n) of v, n>=1
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline))
+void sse_store_lanes(int *dst, __m128i v, const int n) {
+	if(n>=4)
+		_mm_storeu_si128((__m128i *)dst,v);
+	else if(n>=2)
+		_mm_storel_epi64((__m128i *)dst,v);
+	else
+		dst[0]=_mm_cvtsi128_si32(v);
+	if(n==3)
+		dst[2]=_mm_extract_epi32(v,2);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+void avx2_store_lanes(int *dst, __m256i v, const int n) {
+	if(n>=8)
+		_mm256_storeu_si256((__m256i *)dst,v);
+	else if(n>4) {
+		_mm_storeu_si128((__m128i *)dst,_mm256_castsi256_si128(v));
+		sse_store_lanes(dst+4,_mm256_extracti128_si256(v,1),n-4);
+	}
+	else
+		sse_store_lanes(dst,_mm256_castsi256_si128(v),n);
+}
+
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline))
+__m128i sse_divide(__m128i v, const divisor_t *D) {
+	__m128i a=_mm_abs_epi32(v), magic=_mm_set1_epi32((int)D->magic);
+	__m128i even=_mm_srli_epi64(_mm_mul_epu32(a,magic),32);
+	__m128i odd=_mm_mul_epu32(_mm_srli_epi64(a,32),magic);
+	__m128i t=_mm_blend_epi16(even,odd,0xCC);
+	__m128i q=_mm_add_epi32(t,_mm_srl_epi32(_mm_sub_epi32(a,t),_mm_cvtsi32_si128(D->sh1)));
+	q=_mm_srl_epi32(q,_mm_cvtsi32_si128(D->sh2));
+	return _mm_sign_epi32(q,v);
+}
+
+// SSE4.1 kernel: each row is multiplied 4 columns at a time, 4 rows are summed with hadd
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline))
+void sse_kernel(matrix_t *M, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	__m128i x[3], p[12], s[3], vmax=_mm_setzero_si128();
+	int i,j,g,max;
+	divisor_t D;
+	#pragma GCC unroll 16
+	for(j=0;j<2;j++)
+		x[j]=j*4<n?_mm_and_si128(_mm_loadu_si128((__m128i *)&Vin->data[j*4]),_mm_loadu_si128((__m128i *)(LANE_MASK(n)+j*4))):_mm_setzero_si128();
+	// only 2 columns left in the row: 4 would read past the end of a vector_t
+	x[2]=n>8?_mm_loadl_epi64((__m128i *)&Vin->data[8]):_mm_setzero_si128();
+	#pragma GCC unroll 16
+	for(i=0;i<(m+3)/4*4;i++) {
+		p[i]=_mm_setzero_si128();
+		if(i>=m)
+			continue;
+		p[i]=_mm_mullo_epi32(_mm_loadu_si128((__m128i *)&M->data[i][0]),x[0]);
+		if(n>4)
+			p[i]=_mm_add_epi32(p[i],_mm_mullo_epi32(_mm_loadu_si128((__m128i *)&M->data[i][4]),x[1]));
+		if(n>8)
+			p[i]=_mm_add_epi32(p[i],_mm_mullo_epi32(_mm_loadl_epi64((__m128i *)&M->data[i][8]),x[2]));
+	}
+	#pragma GCC unroll 16
+	for(g=0;g<(m+3)/4;g++) {
+		s[g]=_mm_hadd_epi32(_mm_hadd_epi32(p[4*g],p[4*g+1]),_mm_hadd_epi32(p[4*g+2],p[4*g+3]));
+		vmax=_mm_max_epi32(vmax,s[g]); // rows past m are 0 and do not change the max
+	}
+	vmax=_mm_max_epi32(vmax,_mm_shuffle_epi32(vmax,_MM_SHUFFLE(1,0,3,2)));
+	vmax=_mm_max_epi32(vmax,_mm_shuffle_epi32(vmax,_MM_SHUFFLE(2,3,0,1)));
+	max=_mm_cvtsi128_si32(vmax);
+	if(max/2) {
+		D=get_divisor(max/2);
+		#pragma GCC unroll 16
+		for(g=0;g<(m+3)/4;g++)
+			s[g]=sse_divide(s[g],&D);
+	}
+	Vout->size=m;
+	#pragma GCC unroll 16
+	for(g=0;g<(m+3)/4;g++)
+		sse_store_lanes(&Vout->data[g*4],s[g],m-g*4);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+__m256i avx2_divide(__m256i v, const divisor_t *D) {
+	__m256i a=_mm256_abs_epi32(v), magic=_mm256_set1_epi32((int)D->magic);
+	__m256i even=_mm256_srli_epi64(_mm256_mul_epu32(a,magic),32);
+	__m256i odd=_mm256_mul_epu32(_mm256_srli_epi64(a,32),magic);
+	__m256i t=_mm256_blend_epi32(even,odd,0xAA);
+	__m256i q=_mm256_add_epi32(t,_mm256_srl_epi32(_mm256_sub_epi32(a,t),_mm_cvtsi32_si128(D->sh1)));
+	q=_mm256_srl_epi32(q,_mm_cvtsi32_si128(D->sh2));
+	return _mm256_sign_epi32(q,v);
+}
+
+// AVX2 kernel: each row is multiplied 8 columns at a time, 8 rows are summed with hadd
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+void avx2_kernel(matrix_t *M, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	__m256i x, p[16], h[4], s[2], vmax;
+	__m128i xhi=_mm_setzero_si128(), m128;
+	int i,g,max;
+	divisor_t D;
+	x=_mm256_and_si256(_mm256_loadu_si256((__m256i *)Vin->data),_mm256_loadu_si256((__m256i *)LANE_MASK(n)));
+	if(n>8) // columns 8 and 9
+		xhi=_mm_loadl_epi64((__m128i *)&Vin->data[8]);
+	#pragma GCC unroll 16
+	for(i=0;i<(m+7)/8*8;i++) {
+		p[i]=_mm256_setzero_si256();
+		if(i>=m)
+			continue;
+		p[i]=_mm256_mullo_epi32(_mm256_loadu_si256((__m256i *)&M->data[i][0]),x);
+		if(n>8)
+			p[i]=_mm256_add_epi32(p[i],_mm256_zextsi128_si256(_mm_mullo_epi32(_mm_loadl_epi64((__m128i *)&M->data[i][8]),xhi)));
+	}
+	vmax=_mm256_setzero_si256();
+	#pragma GCC unroll 16
+	for(g=0;g<(m+7)/8;g++) {
+		#pragma GCC unroll 16
+		for(i=0;i<4;i++)
+			h[i]=_mm256_hadd_epi32(p[8*g+2*i],p[8*g+2*i+1]);
+		h[0]=_mm256_hadd_epi32(h[0],h[1]);
+		h[2]=_mm256_hadd_epi32(h[2],h[3]);
+		s[g]=_mm256_add_epi32(_mm256_permute2x128_si256(h[0],h[2],0x20),_mm256_permute2x128_si256(h[0],h[2],0x31));
+		vmax=_mm256_max_epi32(vmax,s[g]); // rows past m are 0 and do not change the max
+	}
+	m128=_mm_max_epi32(_mm256_castsi256_si128(vmax),_mm256_extracti128_si256(vmax,1));
+	m128=_mm_max_epi32(m128,_mm_shuffle_epi32(m128,_MM_SHUFFLE(1,0,3,2)));
+	m128=_mm_max_epi32(m128,_mm_shuffle_epi32(m128,_MM_SHUFFLE(2,3,0,1)));
+	max=_mm_cvtsi128_si32(m128);
+	if(max/2) {
+		D=get_divisor(max/2);
+		#pragma GCC unroll 16
+		for(g=0;g<(m+7)/8;g++)
+			s[g]=avx2_divide(s[g],&D);
+	}
+	Vout->size=m;
+	avx2_store_lanes(Vout->data,s[0],m<8?m:8);
+	if(m>8) // rows 8 and 9
+		_mm_storel_epi64((__m128i *)&Vout->data[8],_mm256_castsi256_si128(s[1]));
+}
+
+#define KERNEL(isa,m,n) \
+	void isa##_multiply_##m##x##n(matrix_t *M, vector_t *Vin, vector_t *Vout) { isa##_kernel(M,Vin,Vout,m,n); }
+#define KERNELS(isa, attr) \
+	attr KERNEL(isa,3,3) attr KERNEL(isa,3,5) attr KERNEL(isa,3,10) \
+	attr KERNEL(isa,5,3) attr KERNEL(isa,5,5) attr KERNEL(isa,5,10) \
+	attr KERNEL(isa,10,3) attr KERNEL(isa,10,5) attr KERNEL(isa,10,10)
+#define KERNEL_TABLE(isa) { \
+	{isa##_multiply_3x3, isa##_multiply_3x5, isa##_multiply_3x10}, \
+	{isa##_multiply_5x3, isa##_multiply_5x5, isa##_multiply_5x10}, \
+	{isa##_multiply_10x3, isa##_multiply_10x5, isa##_multiply_10x10} }
+
+KERNELS(scalar, )
+KERNELS(sse, __attribute__((target("sse4.1"))))
+KERNELS(avx2, __attribute__((target("avx2"))))
+
+// PACKED MATRICES
+// init_matrix only uses -1 and +1, so a row fits in the bits of a short: bit j is set if
+// entry j is -1. Then out_i = sum(Vin) - 2*(sum of the Vin_j with bit j of row i set)
+typedef void (*packed_fn)(packed_matrix_t *P, vector_t *Vin, vector_t *Vout);
+
+static inline __attribute__((always_inline))
+void scalar_packed_kernel(packed_matrix_t *P, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	int i,j,sum=0,neg,max=0;
+	unsigned bits;
+	divisor_t D;
+	Vout->size=m;
+#pragma GCC unroll 16
+	for(j=0;j<n;j++)
+		sum+=Vin->data[j];
+#pragma GCC unroll 16
+	for(i=0;i<m;i++) {
+		neg=0;
+		for(bits=P->sign[i];bits;bits&=bits-1)
+			neg+=Vin->data[__builtin_ctz(bits)];
+		Vout->data[i]=sum-2*neg;
+		if(Vout->data[i]>max)
+			max=Vout->data[i];
+	}
+	if(max/2) {
+		D=get_divisor(max/2);
+#pragma GCC unroll 16
+		for(i=0;i<m;i++)
+			Vout->data[i]=divide(Vout->data[i],&D);
+	}
+}
+
+// SSE4.1: rows are the lanes; for each column, the lanes whose bit is set take Vin_j
+__attribute__((target("sse4.1")))
+static inline __attribute__((always_inline))
+void sse_packed_kernel(packed_matrix_t *P, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	__m128i sign[3], neg[3], x, sum, vmax=_mm_setzero_si128();
+	int g,j,max,s=0;
+	divisor_t D;
+#pragma GCC unroll 16
+	for(j=0;j<n;j++)
+		s+=Vin->data[j];
+	sum=_mm_set1_epi32(s);
+#pragma GCC unroll 4
+	for(g=0;g<(m+3)/4;g++) {
+		sign[g]=_mm_cvtepu16_epi32(g<2?_mm_loadl_epi64((__m128i *)&P->sign[g*4]):_mm_cvtsi32_si128(P->sign[8]|P->sign[9]<<16));
+		neg[g]=_mm_setzero_si128();
+	}
+#pragma GCC unroll 16
+	for(j=0;j<n;j++) {
+		x=_mm_set1_epi32(Vin->data[j]);
+#pragma GCC unroll 4
+		for(g=0;g<(m+3)/4;g++) // bit j moved to the sign bit and spread to the whole lane
+			neg[g]=_mm_add_epi32(neg[g],_mm_and_si128(x,_mm_srai_epi32(_mm_slli_epi32(sign[g],31-j),31)));
+	}
+#pragma GCC unroll 4
+	for(g=0;g<(m+3)/4;g++) {
+		neg[g]=_mm_sub_epi32(sum,_mm_slli_epi32(neg[g],1));
+		// rows past m must not change the max
+		vmax=_mm_max_epi32(vmax,g*4+4>m?_mm_and_si128(neg[g],_mm_loadu_si128((__m128i *)LANE_MASK(m-g*4))):neg[g]);
+	}
+	vmax=_mm_max_epi32(vmax,_mm_shuffle_epi32(vmax,_MM_SHUFFLE(1,0,3,2)));
+	vmax=_mm_max_epi32(vmax,_mm_shuffle_epi32(vmax,_MM_SHUFFLE(2,3,0,1)));
+	max=_mm_cvtsi128_si32(vmax);
+	if(max/2) {
+		D=get_divisor(max/2);
+#pragma GCC unroll 4
+		for(g=0;g<(m+3)/4;g++)
+			neg[g]=sse_divide(neg[g],&D);
+	}
+	Vout->size=m;
+#pragma GCC unroll 4
+	for(g=0;g<(m+3)/4;g++)
+		sse_store_lanes(&Vout->data[g*4],neg[g],m-g*4);
+}
+
+// AVX2: same as SSE4.1 with 8 rows per register
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline))
+void avx2_packed_kernel(packed_matrix_t *P, vector_t *Vin, vector_t *Vout, const int m, const int n) {
+	__m256i sign[2], neg[2], x, sum, vmax=_mm256_setzero_si256();
+	__m128i m128;
+	int g,j,max,s=0;
+	divisor_t D;
+#pragma GCC unroll 16
+	for(j=0;j<n;j++)
+		s+=Vin->data[j];
+	sum=_mm256_set1_epi32(s);
+	sign[0]=_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)&P->sign[0]));
+	sign[1]=_mm256_cvtepu16_epi32(_mm_cvtsi32_si128(P->sign[8]|P->sign[9]<<16));
+	neg[0]=neg[1]=_mm256_setzero_si256();
+#pragma GCC unroll 16
+	for(j=0;j<n;j++) {
+		x=_mm256_set1_epi32(Vin->data[j]);
+#pragma GCC unroll 2
+		for(g=0;g<(m+7)/8;g++) // bit j moved to the sign bit and spread to the whole lane
+			neg[g]=_mm256_add_epi32(neg[g],_mm256_and_si256(x,_mm256_srai_epi32(_mm256_slli_epi32(sign[g],31-j),31)));
+	}
+#pragma GCC unroll 2
+	for(g=0;g<(m+7)/8;g++) {
+		neg[g]=_mm256_sub_epi32(sum,_mm256_slli_epi32(neg[g],1));
+		// rows past m must not change the max
+		vmax=_mm256_max_epi32(vmax,g*8+8>m?_mm256_and_si256(neg[g],_mm256_loadu_si256((__m256i *)LANE_MASK(m-g*8))):neg[g]);
+	}
+	m128=_mm_max_epi32(_mm256_castsi256_si128(vmax),_mm256_extracti128_si256(vmax,1));
+	m128=_mm_max_epi32(m128,_mm_shuffle_epi32(m128,_MM_SHUFFLE(1,0,3,2)));
+	m128=_mm_max_epi32(m128,_mm_shuffle_epi32(m128,_MM_SHUFFLE(2,3,0,1)));
+	max=_mm_cvtsi128_si32(m128);
+	if(max/2) {
+		D=get_divisor(max/2);
+#pragma GCC unroll 2
+		for(g=0;g<(m+7)/8;g++)
+			neg[g]=avx2_divide(neg[g],&D);
+	}
+	Vout->size=m;
+	avx2_store_lanes(Vout->data,neg[0],m<8?m:8);
+	if(m>8) // rows 8 and 9
+		_mm_storel_epi64((__m128i *)&Vout->data[8],_mm256_castsi256_si128(neg[1]));
+}
+
+#define PACKED_KERNEL(isa,m,n) \
+	void isa##_packed_multiply_##m##x##n(packed_matrix_t *P, vector_t *Vin, vector_t *Vout) { isa##_packed_kernel(P,Vin,Vout,m,n); }
+#define PACKED_KERNELS(isa, attr) \
+	attr PACKED_KERNEL(isa,3,3) attr PACKED_KERNEL(isa,3,5) attr PACKED_KERNEL(isa,3,10) \
+	attr PACKED_KERNEL(isa,5,3) attr PACKED_KERNEL(isa,5,5) attr PACKED_KERNEL(isa,5,10) \
+	attr PACKED_KERNEL(isa,10,3) attr PACKED_KERNEL(isa,10,5) attr PACKED_KERNEL(isa,10,10)
+#define PACKED_TABLE(isa) { \
+	{isa##_packed_multiply_3x3, isa##_packed_multiply_3x5, isa##_packed_multiply_3x10}, \
+	{isa##_packed_multiply_5x3, isa##_packed_multiply_5x5, isa##_packed_multiply_5x10}, \
+	{isa##_packed_multiply_10x3, isa##_packed_multiply_10x5, isa##_packed_multiply_10x10} }
+
+PACKED_KERNELS(scalar, )
+PACKED_KERNELS(sse, __attribute__((target("sse4.1"))))
+PACKED_KERNELS(avx2, __attribute__((target("avx2"))))
+
+
+int has_avx2(void) {
+	return __builtin_cpu_supports("avx2");
+}
+
+int has_sse41(void) {
+	return __builtin_cpu_supports("sse4.1");
+}
+
+// kernel sets, indexed by [size class of m][size class of k]
+typedef struct kernels_t {
+	const char *name;
+	int (*supported)(void); // NULL if always available
+	multiply_fn fn[3][3];
+	packed_fn packed[3][3];
+} kernels_t;
+
+const kernels_t kernel_sets[] = {
+	{"avx2", has_avx2, KERNEL_TABLE(avx2), PACKED_TABLE(avx2)},
+	{"sse4.1", has_sse41, KERNEL_TABLE(sse), PACKED_TABLE(sse)},
+	{"scalar", NULL, KERNEL_TABLE(scalar), PACKED_TABLE(scalar)},
+	{"generic", NULL, {{multiply, multiply, multiply}, {multiply, multiply, multiply}, {multiply, multiply, multiply}}, PACKED_TABLE(scalar)},
+};
+#define N_KERNEL_SETS (int)(sizeof(kernel_sets)/sizeof(kernel_sets[0]))
+
+const kernels_t *kernels; // set by kernels_init
+
+// selects the named kernel set (the best one this CPU supports if name is NULL);
+// returns FALSE if it does not exist or is not supported
+boolean kernels_init(const char *name) {
+	int i;
+	for(i=0;i<DIVISOR_TABLE;i++)
+		divisor_init(&divisors[i], i?i:1);
+	__builtin_cpu_init();
+	for(i=0;i<N_KERNEL_SETS;i++) {
+		if(name!=NULL && strcmp(name,kernel_sets[i].name)!=0)
+			continue;
+		if(kernel_sets[i].supported==NULL || kernel_sets[i].supported()) {
+			kernels=&kernel_sets[i];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// same result as multiply(), with the kernel specialized for the shape of M
+void fast_multiply(matrix_t *M, vector_t *Vin, vector_t *Vout) {
+	kernels->fn[size_class(M->m)][size_class(M->n)](M,Vin,Vout);
+}
+
+// same result as multiply() on the matrix P was packed from
+void packed_multiply(packed_matrix_t *P, vector_t *Vin, vector_t *Vout) {
+	kernels->packed[size_class(P->m)][size_class(P->n)](P,Vin,Vout);
+}
+
+// KERNEL SELF-TEST
+// ./A2 -K checks every kernel set this CPU supports, int and packed, against multiply()
+// on all nine m x k shapes: SELFTEST_ROUNDS random matrices and inputs per shape, small
+// ones and ones as large as a row of products can take without overflowing, with garbage
+// past k in the input and in the output beforehand. Returns the number of mismatches
+#define SELFTEST_ROUNDS 20000
+
+// a random input element: small, near the limit or anywhere in between
+int selftest_value(void) {
+	const int limit=INT_MAX/MAX_VSIZE; // a row of MAX_VSIZE products of +-1 cannot overflow
+	switch(rng_below(&rng,4)) {
+		case 0: return (int)rng_below(&rng,201)-100;
+		case 1: return rng_below(&rng,2)?limit-(int)rng_below(&rng,100):-limit+(int)rng_below(&rng,100);
+		default: return (int)rng_below(&rng,2*(uint32_t)limit+1)-limit;
+	}
+}
+
+// writes the first mismatch of a shape to stderr; TRUE if Vout matches Vref
+boolean selftest_same(const char *set, const char *kind, matrix_t *M, vector_t *Vin, vector_t *Vout, vector_t *Vref) {
+	int i;
+	if(Vout->size==Vref->size && memcmp(Vout->data,Vref->data,Vref->size*sizeof(int))==0)
+		return TRUE;
+	fprintf(stderr,"%s %s %dx%d: got size %d,", set, kind, M->m, M->n, Vout->size);
+	for(i=0;i<M->m;i++)
+		fprintf(stderr," %d", Vout->data[i]);
+	fprintf(stderr,"; multiply() gives");
+	for(i=0;i<M->m;i++)
+		fprintf(stderr," %d", Vref->data[i]);
+	fprintf(stderr,"; input");
+	for(i=0;i<M->n;i++)
+		fprintf(stderr," %d", Vin->data[i]);
+	fprintf(stderr,"\n");
+	return FALSE;
+}
+
+long kernels_selftest(void) {
+	matrix_t M;
+	packed_matrix_t P;
+	vector_t Vin, Vout, Vref;
+	long failed=0, set_failed, shape_failed[2];
+	int s, m, k, r, j;
+
+	for(s=0;s<N_KERNEL_SETS;s++) {
+		const kernels_t *K=&kernel_sets[s];
+		if(K->supported!=NULL && !K->supported()) {
+			printf("%-8s not supported by this CPU, skipped\n", K->name);
+			continue;
+		}
+		set_failed=0;
+		for(m=0;m<3;m++)
+			for(k=0;k<3;k++) {
+				shape_failed[0]=shape_failed[1]=0;
+				for(r=0;r<SELFTEST_ROUNDS;r++) {
+					init_matrix(&M,class_size[k],class_size[m]);
+					pack_matrix(&P,&M);
+					Vin.size=class_size[rng_below(&rng,k+1)]; // a vector that fits k
+					for(j=0;j<MAX_VSIZE;j++)
+						Vin.data[j]=j<class_size[k]?selftest_value():(int)rng_next(&rng);
+					multiply(&M,&Vin,&Vref);
+
+					memset(&Vout,0xa5,sizeof(Vout));
+					K->fn[m][k](&M,&Vin,&Vout);
+					if(!selftest_same(K->name,"int",&M,&Vin,&Vout,&Vref) && shape_failed[0]++ > 0)
+						fprintf(stderr,"(further mismatches of this shape not shown)\n");
+					memset(&Vout,0x5a,sizeof(Vout));
+					K->packed[m][k](&P,&Vin,&Vout);
+					if(!selftest_same(K->name,"packed",&M,&Vin,&Vout,&Vref) && shape_failed[1]++ > 0)
+						fprintf(stderr,"(further mismatches of this shape not shown)\n");
+					if(shape_failed[0]+shape_failed[1]>1)
+						break;
+				}
+				set_failed+=shape_failed[0]+shape_failed[1];
+			}
+		printf("%-8s %s\n", K->name, set_failed?"FAILED":"ok");
+		failed+=set_failed;
+	}
+	return failed;
+}
+
 // display the state of the monitor
 void show_buffer(monitor_t *mon) {
-	int i=BUFFER_SIZE-mon->capacity, j=mon->out;
-	printf("Remaining capacity: %d (%.0f%%)\nContent:\n", mon->capacity, (double)100*mon->capacity/BUFFER_SIZE);
+	int i=mon->size-mon->capacity, j=mon->out;
+	printf("Remaining capacity: %d (%.0f%%)\nContent:\n", mon->capacity, (double)100*mon->capacity/mon->size);
 	while(i>0) {
 		printf("%d\t",mon->buffer[j]);
-		j=(j+1)%BUFFER_SIZE;
+		j=(j+1)&mon->mask;
 		i--;
 	}
 	puts("");
@@ -231,12 +1246,12 @@ void show_buffer(monitor_t *mon) {
 boolean sanity_check(monitor_t *mon) {
 	int steps, index, skip;
 	boolean result=TRUE;
-	if(mon->next_size==0) {
-		if(mon->capacity!=BUFFER_SIZE)
+	if(mon->next_size==0 && mon->claimed==0 && mon->reserved==0) {
+		if(mon->capacity!=mon->size)
 			result = FALSE;
 	}
 	else {
-		steps = BUFFER_SIZE-mon->capacity;
+		steps = mon->size-mon->capacity;
 		index = mon->out;
 		while(steps>0) {
 			printf("sanity_check: position %d", index);
@@ -246,7 +1261,7 @@ boolean sanity_check(monitor_t *mon) {
 				result = FALSE;
 			else {
 				steps-=(skip+1);
-				index=(index+skip+1)%BUFFER_SIZE;
+				index=(index+skip+1)&mon->mask;
 			}
 		}
 		if(steps!=0)
@@ -257,159 +1272,1569 @@ boolean sanity_check(monitor_t *mon) {
 
 // IMPLEMENTATION OF MONITOR API
 // download copies a vector of size up to k to V
-void download(monitor_t *mon, int k, vector_t *V)
+boolean download(monitor_t *mon, int k, vector_t *V)
 {
-    pthread_mutex_lock(&mon->mutex);
+    metrics_call_t c;
+    boolean done;
+    metrics_begin(&c, EV_DOWNLOAD);
+    done = mon->engine->download(mon, k, V);
+    metrics_end(mon, &c, EV_DOWNLOAD, k, done);
+    return done;
+}
+
+// upload copies V to the buffer
+boolean upload(monitor_t *mon, vector_t *V)
+{
+    metrics_call_t c;
+    boolean done;
+    metrics_begin(&c, EV_UPLOAD);
+    done = mon->engine->upload(mon, V);
+    metrics_end(mon, &c, EV_UPLOAD, V->size, done);
+    return done;
+}
+
+// download_batch moves up to n (at most MAX_BATCH) vectors of size up to k to V in one go:
+// it blocks until the first one is available, then takes the following records as long as
+// they fit k; returns the number of vectors moved
+int download_batch(monitor_t *mon, int k, vector_t *V, int n)
+{
+    metrics_call_t c;
+    metrics_begin(&c, EV_DOWNLOAD);
+    n = mon->engine->download_batch(mon, k, V, n);
+    metrics_end(mon, &c, EV_DOWNLOAD, k, n);
+    return n;
+}
+
+// upload_batch copies the n vectors in V to the buffer, in order
+boolean upload_batch(monitor_t *mon, vector_t *V, int n)
+{
+    metrics_call_t c;
+    boolean done;
+    metrics_begin(&c, EV_UPLOAD);
+    done = mon->engine->upload_batch(mon, V, n);
+    metrics_end(mon, &c, EV_UPLOAD, V[0].size, done ? n : 0);
+    return done;
+}
+
+// zero-copy access: download_begin blocks like download and returns the span of the
+// record taken, which stays in the buffer until download_end. upload_begin reserves room
+// for a vector of the given size, blocking only if wait is TRUE, and returns its span;
+// downloaders see it after upload_commit. Spans may end in any order, the buffer frees
+// and publishes them in order. Return FALSE once the monitor is closed, on an engine
+// without zero-copy access, and (upload_begin) if there is no room and wait is FALSE.
+// A thread holding a download span must not wait for room: it would hold the space it
+// is about to free
+boolean download_begin(monitor_t *mon, int k, span_t *S)
+{
+    metrics_call_t c;
+    boolean done;
+    if (mon->engine->download_begin == NULL)
+        return FALSE;
+    metrics_begin(&c, EV_DOWNLOAD);
+    done = mon->engine->download_begin(mon, k, S);
+    metrics_end(mon, &c, EV_DOWNLOAD, k, done);
+    return done;
+}
+
+void download_end(monitor_t *mon, span_t *S)
+{
+    mon->engine->download_end(mon, S);
+}
+
+boolean upload_begin(monitor_t *mon, int size, span_t *S, boolean wait)
+{
+    metrics_call_t c;
+    boolean done;
+    if (mon->engine->upload_begin == NULL)
+        return FALSE;
+    metrics_begin(&c, EV_UPLOAD);
+    done = mon->engine->upload_begin(mon, size, S, wait);
+    metrics_end(mon, &c, EV_UPLOAD, size, done);
+    return done;
+}
+
+void upload_commit(monitor_t *mon, span_t *S)
+{
+    mon->engine->upload_commit(mon, S);
+}
+
+// the span as a vector_t, if it does not wrap; NULL otherwise
+vector_t *span_vector(span_t *S)
+{
+    return S->len[1] == 0 ? (vector_t *)S->part[0] : NULL;
+}
+
+// ADAPTIVE WAITING
+// with the critical sections this short, a blocked thread is often unblocked within a
+// microsecond, and sleeping costs it two context switches. So a thread about to sleep
+// first spins with pause instructions on the word its waker changes (the futex word of
+// its wait queue or node, or mon->changes in the mutex engine) and only parks once its
+// budget is over. The budget is twice the mean of the thread's recent waits of the same
+// operation, between SPIN_MIN_NS and SPIN_MAX_NS; when those waits were longer than
+// SPIN_MAX_NS spinning only delays the sleep, and the budget drops to SPIN_MIN_NS until
+// shorter waits bring the mean back. On a single CPU the waker cannot run while the
+// waiter spins, so nobody spins (as for the barrier of the slave). n_spins and
+// n_spin_hits count the spins and the ones that ended the wait, see METRICS
+
+void spin_init(void) {
+	if(SPIN_MAX_NS==0 || sysconf(_SC_NPROCESSORS_ONLN)<2)
+		return;
+	tsc_calibrate();
+	spin_min_ticks=SPIN_MIN_NS/metrics_ns_per_tick;
+	spin_max_ticks=SPIN_MAX_NS/metrics_ns_per_tick;
+}
+
+// a wait of op (0 download, 1 upload) took ticks, spinning or not; the mean moves by
+// an eighth of the difference, and counts no wait as longer than twice SPIN_MAX_NS so
+// that a few short ones bring it back under it
+static inline void spin_learn(int op, long ticks) {
+	if(ticks>2*spin_max_ticks)
+		ticks=2*spin_max_ticks;
+	spin_mean_ticks[op]+=(ticks-spin_mean_ticks[op])/8;
+}
 
-    while(mon->next_size == 0 || mon->next_size > k)
+// spins while *word is val, for the budget of op; TRUE if it changed. *start is the
+// tick the wait started, for spin_parked
+boolean spin_wait(atomic_uint *word, unsigned val, int op, uint64_t *start) {
+	long mean=spin_mean_ticks[op], budget;
+	uint64_t now, end;
+
+	if(spin_max_ticks==0)
+		return FALSE;
+	budget=mean>spin_max_ticks?spin_min_ticks:2*mean;
+	budget=budget<spin_min_ticks?spin_min_ticks:(budget>spin_max_ticks?spin_max_ticks:budget);
+	*start=now=__rdtsc();
+	end=now+budget;
+	n_spins++;
+	while(atomic_load_explicit(word,memory_order_acquire)==val) {
+		if(now>=end)
+			return FALSE;
+		_mm_pause();
+		now=__rdtsc();
+	}
+	n_spin_hits++;
+	spin_learn(op,now-*start);
+	return TRUE;
+}
+
+// the thread slept after spin_wait returned FALSE and is awake again; start is 0 if it
+// did not spin
+void spin_parked(int op, uint64_t start) {
+	if(start!=0)
+		spin_learn(op,__rdtsc()-start);
+}
+
+// FUTEX_WAIT on word while it is val, spinning first
+void spin_futex_wait(atomic_uint *word, unsigned val, int op) {
+	uint64_t start=0;
+	if(spin_wait(word,val,op,&start))
+		return;
+	futex(word,FUTEX_WAIT_PRIVATE,val);
+	spin_parked(op,start);
+}
+
+// pthread_cond_wait on cond with the monitor mutex, spinning first. The mutex is released
+// while spinning on mon->changes: as every signal follows a change, if it did not change
+// no signal was missed and the thread sleeps; if it did, the thread returns to check its
+// condition again, as after any wakeup
+void monitor_wait(monitor_t *mon, pthread_cond_t *cond, int op) {
+	unsigned changes=atomic_load_explicit(&mon->changes,memory_order_relaxed);
+	uint64_t start=0;
+	boolean changed;
+
+	if(spin_max_ticks!=0) {
+		pthread_mutex_unlock(&mon->mutex);
+		changed=spin_wait(&mon->changes,changes,op,&start);
+		pthread_mutex_lock(&mon->mutex);
+		if(changed || atomic_load_explicit(&mon->changes,memory_order_relaxed)!=changes)
+			return;
+	}
+	pthread_cond_wait(cond,&mon->mutex);
+	spin_parked(op,start);
+}
+
+// MUTEX ENGINE
+// one mutex and a condition variable per size class (per waiting uploader for FVF)
+
+// waits until the next vector fits k; mutex held; returns FALSE if the monitor was closed
+boolean mutex_wait_download(monitor_t *mon, int k)
+{
+    while(!mon->closed && (mon->next_size == 0 || mon->next_size > k))
         {
             if (k == 3)
             {
                 mon->n_d3++;
-                printf("Thread %lu waiting to download 3\n", pthread_self());
-                printf("\n");
-                pthread_cond_wait(&mon->can_download3, &mon->mutex);
+                LOG_WAIT(EV_WAIT_DOWNLOAD, 3);
+                monitor_wait(mon, &mon->can_download3, 0);
+                n_wakeups++;
                 mon->n_d3--;
             }
             else if (k == 5)
             {
                 mon->n_d5++;
-                printf("Thread %lu waiting to download 5\n", pthread_self());
-                printf("\n");
-                pthread_cond_wait(&mon->can_download5, &mon->mutex);
+                LOG_WAIT(EV_WAIT_DOWNLOAD, 5);
+                monitor_wait(mon, &mon->can_download5, 0);
+                n_wakeups++;
                 mon->n_d5--;
             }
             else if (k == 10)
             {
                 mon->n_d10++;
-                printf("Thread %lu waiting to download 10\n", pthread_self());
-                printf("\n");
-                pthread_cond_wait(&mon->can_download10, &mon->mutex);
+                LOG_WAIT(EV_WAIT_DOWNLOAD, 10);
+                monitor_wait(mon, &mon->can_download10, 0);
+                n_wakeups++;
                 mon->n_d10--;
             }
         }
-    from_buffer(mon, V);
-
-    if (SVF) 
-    {
-        // Shortest Vector First to upload
-        if (mon->n_u3 > 0 && mon->capacity >= 3)
-        {
-            pthread_cond_signal(&mon->can_upload3);
-        }
-        else if (mon->n_u5 > 0 && mon->capacity >= 5)
-        {
-            pthread_cond_signal(&mon->can_upload5);
-        }
-        else if (mon->n_u10 > 0  && mon->capacity >= 10)
-        {
-            pthread_cond_signal(&mon->can_upload10);
-        }
-    } 
-    else if (LVF) 
-    {
-        // Longest Vector First to upload
-        if (mon->n_u10 > 0 && mon->capacity >= 10)
-        {
-            pthread_cond_signal(&mon->can_upload10);
-        }
-        else if (mon->n_u5 > 0 && mon->capacity >= 5)
-        {
-            pthread_cond_signal(&mon->can_upload5);
-        }
-        else if (mon->n_u3 > 0 && mon->capacity >= 3)
-        {
-            pthread_cond_signal(&mon->can_upload3);
-        }
-    } 
-    else if (FVF) 
-    {
-        // First Come First Served to upload
-        if (mon->n_u > 0)
-        {
-            pthread_cond_signal(&mon->can_upload[mon->index_served]);
-            mon->index_served = (mon->index_served + 1) % N_THREADS;
-        }
-    }
-
-    pthread_mutex_unlock(&mon->mutex);
+    return !mon->closed;
 }
 
-void upload(monitor_t *mon, vector_t *V) 
+// signals the waiting downloader with the longest k that fits the next vector; mutex held
+void mutex_signal_download(monitor_t *mon)
 {
-    pthread_mutex_lock(&mon->mutex);
-
-    if (SVF || LVF) 
-	{
-        // Shortest Vector First or Longest Vector First 
-        while(mon->capacity < size_of(V))
-        {
-            if (V->size == 10)
-            {
-                mon->n_u10++;
-                pthread_cond_wait(&mon->can_upload10, &mon->mutex);
-                mon->n_u10--;
-            }
-            else if (V->size == 5)
-            {
-                mon->n_u5++;
-                pthread_cond_wait(&mon->can_upload5, &mon->mutex);
-                mon->n_u5--;
-            }
-            else if (V->size == 3)
-            {
-                mon->n_u3++;
-                pthread_cond_wait(&mon->can_upload3, &mon->mutex);
-                mon->n_u3--;
-            }
-        }
-        to_buffer(mon, V);
-        mon->next_size = V->size;
-    } 
-	else if (FVF) 
-	{
-        // First Come First Served
-        while(mon->n_u > 0 || mon->capacity < size_of(V))
-        {
-            mon->n_u ++;
-            mon->index_in = (mon->index_in + 1) % N_THREADS;
-            pthread_cond_wait(&mon->can_upload[mon->index_in], &mon->mutex);
-            mon->n_u --;
-        }
-        to_buffer(mon, V);
-        mon->next_size = V->size;
-    }
-
-    // signal the threads that can download
-    if (mon->n_d10 > 0 && mon->next_size == 10)
+    if (mon->next_size == 0)
+        return;
+    if (mon->n_d10 > 0)
     {
         pthread_cond_signal(&mon->can_download10);
     }
-    else if (mon->n_d5 > 0 && mon->next_size == 5)
+    else if (mon->n_d5 > 0 && mon->next_size <= 5)
     {
         pthread_cond_signal(&mon->can_download5);
     }
-    else if (mon->n_d3 > 0 && mon->next_size == 3)
+    else if (mon->n_d3 > 0 && mon->next_size <= 3)
     {
         pthread_cond_signal(&mon->can_download3);
     }
-
-    pthread_mutex_unlock(&mon->mutex);
 }
 
-void monitor_init(monitor_t *mon)
+boolean mutex_download(monitor_t *mon, int k, vector_t *V)
 {
-    // initialization of tools commmon to all policies
-    pthread_mutex_init(&mon->mutex, NULL);
-    pthread_cond_init(&mon->can_download3, NULL);
-    pthread_cond_init(&mon->can_download5, NULL);
-    pthread_cond_init(&mon->can_download10, NULL);
-    mon->n_d3 = 0;
-    mon->n_d5 = 0;
-    mon->n_d10 = 0;
+    monitor_lock(mon);
 
-
-    // for SVF and LVF
+    if (!mutex_wait_download(mon, k))
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    from_buffer(mon, V);
+
+    mon->policy->signal_upload(mon);
+    // the next vector may fit another waiting thread
+    mutex_signal_download(mon);
+
+    monitor_unlock(mon);
+    return TRUE;
+}
+
+boolean mutex_upload(monitor_t *mon, vector_t *V) 
+{
+    monitor_lock(mon);
+
+    mon->policy->wait_upload(mon, V);
+    if (mon->closed)
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    to_buffer(mon, V);
+
+    // signal the threads that can download
+    mutex_signal_download(mon);
+
+    monitor_unlock(mon);
+    return TRUE;
+}
+
+int mutex_download_batch(monitor_t *mon, int k, vector_t *V, int n)
+{
+    int i;
+    if (n > MAX_BATCH)
+        n = MAX_BATCH;
+
+    monitor_lock(mon);
+
+    if (!mutex_wait_download(mon, k))
+    {
+        monitor_unlock(mon);
+        return 0;
+    }
+    i = 0;
+    do {
+        from_buffer(mon, &V[i++]);
+        // every vector taken frees room for one more uploader
+        mon->policy->signal_upload(mon);
+    } while (i < n && mon->next_size != 0 && mon->next_size <= k);
+
+    mutex_signal_download(mon);
+
+    monitor_unlock(mon);
+    return i;
+}
+
+boolean mutex_upload_batch(monitor_t *mon, vector_t *V, int n)
+{
+    int i;
+
+    monitor_lock(mon);
+
+    for (i = 0; i < n; i++)
+    {
+        // wait_upload only blocks if V[i] does not fit; the vectors already
+        // uploaded are signalled first, so that downloaders can make room
+        mon->policy->wait_upload(mon, &V[i]);
+        if (mon->closed)
+            break;
+        to_buffer(mon, &V[i]);
+        mutex_signal_download(mon);
+    }
+
+    monitor_unlock(mon);
+    return i == n;
+}
+
+boolean mutex_download_begin(monitor_t *mon, int k, span_t *S)
+{
+    monitor_lock(mon);
+
+    if (!mutex_wait_download(mon, k))
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    ring_claim(mon, S);
+
+    // the next vector may fit another waiting thread
+    mutex_signal_download(mon);
+
+    monitor_unlock(mon);
+    return TRUE;
+}
+
+void mutex_download_end(monitor_t *mon, span_t *S)
+{
+    monitor_lock(mon);
+    ring_release(mon, S);
+    mon->policy->signal_upload(mon);
+    monitor_unlock(mon);
+}
+
+boolean mutex_upload_begin(monitor_t *mon, int size, span_t *S, boolean wait)
+{
+    vector_t V = {.size = size};
+
+    monitor_lock(mon);
+
+    // without waiting, go only if nobody is queued
+    if (!wait && (mon->capacity < size_of(&V) || mon->n_u + mon->n_u3 + mon->n_u5 + mon->n_u10 > 0))
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    mon->policy->wait_upload(mon, &V);
+    if (mon->closed)
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    ring_reserve(mon, size, S);
+
+    monitor_unlock(mon);
+    return TRUE;
+}
+
+void mutex_upload_commit(monitor_t *mon, span_t *S)
+{
+    monitor_lock(mon);
+    ring_commit(mon, S);
+    mutex_signal_download(mon);
+    monitor_unlock(mon);
+}
+
+boolean mutex_download_nowait(monitor_t *mon, int k, vector_t *V)
+{
+    boolean done;
+
+    monitor_lock(mon);
+    done = !mon->closed && mon->next_size != 0 && mon->next_size <= k;
+    if (done)
+    {
+        from_buffer(mon, V);
+        mon->policy->signal_upload(mon);
+        mutex_signal_download(mon);
+    }
+    monitor_unlock(mon);
+    return done;
+}
+
+// only if nobody is queued, as upload_begin without waiting
+boolean mutex_upload_nowait(monitor_t *mon, vector_t *V)
+{
+    boolean done;
+
+    monitor_lock(mon);
+    done = !mon->closed && mon->capacity >= size_of(V) && mon->n_u + mon->n_u3 + mon->n_u5 + mon->n_u10 == 0;
+    if (done)
+    {
+        to_buffer(mon, V);
+        mutex_signal_download(mon);
+    }
+    monitor_unlock(mon);
+    return done;
+}
+
+// the records from out, including the ones being read or written; read without the
+// mutex, so the walk stops at a slot that does not look like a size
+void ring_snapshot(monitor_t *mon, FILE *f)
+{
+    volatile monitor_t *v = mon;
+    int used = v->size - v->capacity, i = v->out, n;
+
+    fprintf(f, "  buffer: %d of %d slots used, next vector %d, records:", used, v->size, v->next_size);
+    while (used > 0)
+    {
+        n = ((volatile int *)v->buffer)[i];
+        if (n < 1 || n > MAX_VSIZE)
+        {
+            fprintf(f, " ?");
+            break;
+        }
+        fprintf(f, " %d", n);
+        i = (i + n + 1) & v->mask;
+        used -= n + 1;
+    }
+    fprintf(f, "\n");
+}
+
+void mutex_snapshot(monitor_t *mon, FILE *f)
+{
+    volatile monitor_t *v = mon;
+
+    ring_snapshot(mon, f);
+    fprintf(f, "  waiting to download: k3 %d, k5 %d, k10 %d; to upload: 3 %d, 5 %d, 10 %d, FVF queue %d; age %d %d %d\n",
+        v->n_d3, v->n_d5, v->n_d10, v->n_u3, v->n_u5, v->n_u10, v->n_u, v->age[0], v->age[1], v->age[2]);
+}
+
+// LOCK-FREE ENGINE
+// uploaders reserve space by moving lf_in forward with a CAS, fill the record and then
+// publish its tag; a downloader claims the head record by swapping its tag to 0, copies
+// it and moves lf_out forward. Threads only sleep on a futex when the fast path fails.
+// The download priority and the upload policies are kept by choosing whom to wake.
+
+long futex(atomic_uint *uaddr, int op, unsigned val) {
+    return syscall(SYS_futex, (unsigned *)uaddr, op, val, NULL, NULL, 0);
+}
+
+void waitq_init(waitq_t *q) {
+    atomic_init(&q->seq, 0);
+    atomic_init(&q->waiters, 0);
+}
+
+// wakes up to n threads sleeping on q
+void waitq_wake(waitq_t *q, int n) {
+    if(n > 0 && atomic_load(&q->waiters) > 0) {
+        atomic_fetch_add(&q->seq, 1);
+        futex(&q->seq, FUTEX_WAKE_PRIVATE, n);
+    }
+}
+
+// free slots of the mutex and handoff engines, read without the mutex
+int mutex_free_slots(monitor_t *mon) {
+    return ((volatile monitor_t *)mon)->capacity;
+}
+
+// free slots; may underestimate it while other threads are moving lf_in/lf_out
+int lf_capacity(monitor_t *mon) {
+    uint_fast64_t out = atomic_load(&mon->lf_out);
+    uint_fast64_t in = atomic_load(&mon->lf_in);
+    return mon->size - (int)(in - out);
+}
+
+// the records from lf_out by their tags; the walk stops at one being written or taken
+void lf_snapshot(monitor_t *mon, FILE *f)
+{
+    uint_fast64_t out = atomic_load(&mon->lf_out), in = atomic_load(&mon->lf_in), pos, tag;
+    int c;
+
+    fprintf(f, "  buffer: %d of %d slots used, records:", (int)(in - out), mon->size);
+    for (pos = out; pos < in; pos += (tag & 0xff) + 1) {
+        tag = atomic_load(&mon->lf_tag[pos & mon->mask]);
+        if ((tag >> 8) != pos) {
+            fprintf(f, " (one being written or taken)");
+            break;
+        }
+        fprintf(f, " %d", (int)(tag & 0xff));
+    }
+    fprintf(f, "\n  waiting to download:");
+    for (c = 0; c < 3; c++)
+        fprintf(f, "%s k%d %d", c ? "," : "", class_size[c], atomic_load(&mon->lf_download[c].waiters));
+    fprintf(f, "; to upload:");
+    for (c = 0; c < 3; c++)
+        fprintf(f, "%s %d %d", c ? "," : "", class_size[c], atomic_load(&mon->lf_upload[c].waiters));
+    fprintf(f, ", FVF tickets %u; age %d %d %d\n", atomic_load(&mon->lf_ticket) - atomic_load(&mon->lf_serving),
+        atomic_load(&mon->lf_age[0]), atomic_load(&mon->lf_age[1]), atomic_load(&mon->lf_age[2]));
+}
+
+// wakes the waiting downloader with the largest k that fits the record at the head
+void lf_wake_downloader(monitor_t *mon) {
+    uint_fast64_t out = atomic_load(&mon->lf_out);
+    uint_fast64_t tag = atomic_load(&mon->lf_tag[out & mon->mask]);
+    int c;
+    if(tag == 0 || (tag >> 8) != out)
+        return; // head not published yet: its uploader will wake someone
+    for(c = 2; c >= size_class(tag & 0xff); c--) {
+        if(atomic_load(&mon->lf_download[c].waiters) > 0) {
+            waitq_wake(&mon->lf_download[c], 1);
+            return;
+        }
+    }
+}
+
+// takes the record at the head if it is published and fits k
+boolean lf_try_download(monitor_t *mon, int k, vector_t *V) {
+    uint_fast64_t out = atomic_load(&mon->lf_out);
+    int idx = out & mon->mask;
+    uint_fast64_t tag = atomic_load(&mon->lf_tag[idx]);
+    span_t S;
+    if(tag == 0 || (tag >> 8) != out || (int)(tag & 0xff) > k)
+        return FALSE;
+    if(!atomic_compare_exchange_strong(&mon->lf_tag[idx], &tag, 0))
+        return FALSE; // another downloader got it
+    // the record is ours until lf_out moves past it
+    ring_span(mon, idx, (tag & 0xff) + 1, &S);
+    span_read(&S, V);
+    atomic_store(&mon->lf_out, out + size_of(V));
+    LOG(LOG_DEBUG, EV_DOWNLOAD, V->size, 0);
+    return TRUE;
+}
+
+// reserves n slots; returns the absolute position of the first one, or -1 if there is no room
+int_fast64_t lf_try_reserve(monitor_t *mon, int n) {
+    uint_fast64_t in = atomic_load(&mon->lf_in), out;
+    for(;;) {
+        out = atomic_load(&mon->lf_out);
+        if((int_fast64_t)(in - out) < 0) {
+            in = atomic_load(&mon->lf_in); // stale lf_in, lf_out already moved past it
+            continue;
+        }
+        if(mon->size - (int)(in - out) < n)
+            return -1;
+        if(atomic_compare_exchange_weak(&mon->lf_in, &in, in + n))
+            return in;
+    }
+}
+
+// fills the reserved record at pos and makes it visible to downloaders
+void lf_publish(monitor_t *mon, uint_fast64_t pos, vector_t *V) {
+    span_t S;
+    ring_span(mon, pos & mon->mask, size_of(V), &S);
+    span_write(&S, V);
+    atomic_store(&mon->lf_tag[pos & mon->mask], (pos << 8) | V->size);
+    LOG(LOG_DEBUG, EV_UPLOAD, V->size, 0);
+}
+
+boolean lf_download(monitor_t *mon, int k, vector_t *V)
+{
+    waitq_t *q = &mon->lf_download[size_class(k)];
+    unsigned seq;
+
+    if(atomic_load(&mon->closed))
+        return FALSE;
+    while(!lf_try_download(mon, k, V)) {
+        atomic_fetch_add(&q->waiters, 1);
+        seq = atomic_load(&q->seq);
+        if(lf_try_download(mon, k, V)) {
+            atomic_fetch_sub(&q->waiters, 1);
+            break;
+        }
+        if(atomic_load(&mon->closed)) {
+            atomic_fetch_sub(&q->waiters, 1);
+            return FALSE;
+        }
+        LOG_WAIT(EV_WAIT_DOWNLOAD, k);
+        spin_futex_wait(&q->seq, seq, 0);
+        n_wakeups++;
+        atomic_fetch_sub(&q->waiters, 1);
+    }
+
+    // the next record may fit someone else, and there is room for uploaders
+    lf_wake_downloader(mon);
+    mon->policy->lf_wake_upload(mon);
+    return TRUE;
+}
+
+boolean lf_upload(monitor_t *mon, vector_t *V)
+{
+    int_fast64_t pos;
+
+    if(atomic_load(&mon->closed))
+        return FALSE;
+    pos = mon->policy->lf_reserve(mon, V);
+    if(pos < 0)
+        return FALSE;
+    lf_publish(mon, pos, V);
+    lf_wake_downloader(mon);
+    return TRUE;
+}
+
+// there is no lock to amortize here, a batch saves the wakeups between records
+int lf_download_batch(monitor_t *mon, int k, vector_t *V, int n)
+{
+    int i;
+    if (n > MAX_BATCH)
+        n = MAX_BATCH;
+
+    if (!lf_download(mon, k, &V[0]))
+        return 0;
+    for (i = 1; i < n && lf_try_download(mon, k, &V[i]); i++);
+    if (i > 1) {
+        lf_wake_downloader(mon);
+        mon->policy->lf_wake_upload(mon);
+    }
+    return i;
+}
+
+// TRUE if an uploader is queued, in FVF order or on a class queue of the other
+// policies: reserving past it would go ahead of uploaders the policy puts first
+boolean lf_upload_queued(monitor_t *mon)
+{
+    return atomic_load(&mon->lf_ticket) != atomic_load(&mon->lf_serving) ||
+        atomic_load(&mon->lf_upload[0].waiters) > 0 || atomic_load(&mon->lf_upload[1].waiters) > 0 ||
+        atomic_load(&mon->lf_upload[2].waiters) > 0;
+}
+
+boolean lf_upload_batch(monitor_t *mon, vector_t *V, int n)
+{
+    int_fast64_t pos = -1;
+    int i, total = 0;
+
+    // if nobody is queued and the whole batch fits, reserve it with one CAS
+    for (i = 0; i < n; i++)
+        total += size_of(&V[i]);
+    if (!lf_upload_queued(mon))
+        pos = lf_try_reserve(mon, total);
+    if (pos < 0) {
+        for (i = 0; i < n; i++)
+            if (!lf_upload(mon, &V[i]))
+                return FALSE;
+        return TRUE;
+    }
+    for (i = 0; i < n; i++) {
+        lf_publish(mon, pos, &V[i]);
+        pos += size_of(&V[i]);
+    }
+    lf_wake_downloader(mon);
+    return TRUE;
+}
+
+boolean lf_download_nowait(monitor_t *mon, int k, vector_t *V)
+{
+    if (atomic_load(&mon->closed) || !lf_try_download(mon, k, V))
+        return FALSE;
+    lf_wake_downloader(mon);
+    mon->policy->lf_wake_upload(mon);
+    return TRUE;
+}
+
+boolean lf_upload_nowait(monitor_t *mon, vector_t *V)
+{
+    int_fast64_t pos;
+
+    if (atomic_load(&mon->closed) || lf_upload_queued(mon) || (pos = lf_try_reserve(mon, size_of(V))) < 0)
+        return FALSE;
+    lf_publish(mon, pos, V);
+    lf_wake_downloader(mon);
+    return TRUE;
+}
+
+// HANDOFF ENGINE
+// like the mutex engine, but a blocked thread waits on its own node instead of a condition
+// variable per size class. Every call queues its node and runs ho_dispatch, which serves
+// every queued node that can proceed: it moves the vector itself (into the downloader's
+// node, or from the uploader's node into the buffer) and then wakes the owner on the
+// node's futex word, after releasing the mutex. A served thread has nothing left to do
+// and does not retake the mutex.
+#define HO_WAITING 0
+#define HO_SLEEPING 1 // the owner is (about to be) in futex wait
+#define HO_DONE 2
+#define HO_CLOSED 3
+
+void ho_push(ho_queue_t *q, ho_node_t *node)
+{
+    node->next = NULL;
+    if (q->tail)
+        q->tail->next = node;
+    else
+        q->head = node;
+    q->tail = node;
+    q->n++;
+}
+
+ho_node_t *ho_pop(ho_queue_t *q)
+{
+    ho_node_t *node = q->head;
+    q->head = node->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+    q->n--;
+    return node;
+}
+
+// futex words to wake once the mutex is released
+typedef struct ho_wakeups_t {
+    atomic_uint *word[MAX_THREADS];
+    int n;
+} ho_wakeups_t;
+
+// sets the final state of a node; if its owner sleeps, it is woken now (w NULL) or by
+// ho_wake. The node may be gone by then: a stale wakeup only makes a waiter recheck
+void ho_grant(ho_node_t *node, unsigned state, ho_wakeups_t *w)
+{
+    if (atomic_exchange(&node->state, state) != HO_SLEEPING)
+        return;
+    if (w != NULL && w->n < MAX_THREADS)
+        w->word[w->n++] = &node->state;
+    else
+        futex(&node->state, FUTEX_WAKE_PRIVATE, 1);
+}
+
+void ho_wake(ho_wakeups_t *w)
+{
+    int i;
+    for (i = 0; i < w->n; i++)
+        futex(w->word[i], FUTEX_WAKE_PRIVATE, 1);
+    w->n = 0;
+}
+
+// size class of the queued downloader to serve next: the largest k that fits the head
+int ho_pick_download(monitor_t *mon)
+{
+    int c;
+    if (mon->next_size == 0)
+        return -1;
+    for (c = 2; c >= 0 && class_size[c] >= mon->next_size; c--)
+        if (mon->ho_download[c].n > 0)
+            return c;
+    return -1;
+}
+
+// serves queued nodes until nobody else can proceed; mutex held
+void ho_dispatch(monitor_t *mon, ho_wakeups_t *w)
+{
+    ho_node_t *node;
+    boolean progress;
+    int c;
+
+    do {
+        progress = FALSE;
+        while ((c = ho_pick_download(mon)) >= 0) {
+            node = ho_pop(&mon->ho_download[c]);
+            from_buffer(mon, node->V);
+            ho_grant(node, HO_DONE, w);
+            progress = TRUE;
+        }
+        while ((c = mon->policy->ho_pick_upload(mon)) >= 0) {
+            node = ho_pop(&mon->ho_upload[c]);
+            to_buffer(mon, node->V);
+            ho_grant(node, HO_DONE, w);
+            progress = TRUE;
+        }
+    } while (progress);
+}
+
+// releases the mutex, wakes the nodes served meanwhile and waits until node is served;
+// returns FALSE if the monitor was closed
+boolean ho_wait(monitor_t *mon, ho_node_t *node, ho_wakeups_t *w, int event, int arg)
+{
+    int op = event == EV_WAIT_UPLOAD;
+    uint64_t start = 0;
+    unsigned state;
+
+    monitor_unlock(mon);
+    ho_wake(w);
+    if (atomic_load(&node->state) == HO_WAITING) {
+        LOG_WAIT(event, arg);
+        // a node served while its owner spins is never slept on, and needs no wakeup
+        if (spin_wait(&node->state, HO_WAITING, op, &start))
+            n_wakeups++;
+    }
+    for (;;) {
+        state = atomic_load(&node->state);
+        if (state == HO_DONE || state == HO_CLOSED)
+            return state == HO_DONE;
+        if (state == HO_WAITING && !atomic_compare_exchange_strong(&node->state, &state, HO_SLEEPING))
+            continue;
+        futex(&node->state, FUTEX_WAIT_PRIVATE, HO_SLEEPING);
+        spin_parked(op, start);
+        n_wakeups++;
+    }
+}
+
+boolean ho_download(monitor_t *mon, int k, vector_t *V)
+{
+    ho_node_t node = {.V = V};
+    ho_wakeups_t w = {.n = 0};
+
+    monitor_lock(mon);
+    if (mon->closed)
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    ho_push(&mon->ho_download[size_class(k)], &node);
+    ho_dispatch(mon, &w);
+    return ho_wait(mon, &node, &w, EV_WAIT_DOWNLOAD, k);
+}
+
+boolean ho_upload(monitor_t *mon, vector_t *V)
+{
+    ho_node_t node = {.V = V};
+    ho_wakeups_t w = {.n = 0};
+
+    monitor_lock(mon);
+    if (mon->closed)
+    {
+        monitor_unlock(mon);
+        return FALSE;
+    }
+    node.arrival = mon->ho_arrival++;
+    ho_push(&mon->ho_upload[size_class(V->size)], &node);
+    ho_dispatch(mon, &w);
+    return ho_wait(mon, &node, &w, EV_WAIT_UPLOAD, V->size);
+}
+
+// the first vector is served like ho_download, the following ones are taken directly
+// as long as they fit k: queued downloaders never fit the head, or they would have been served
+int ho_download_batch(monitor_t *mon, int k, vector_t *V, int n)
+{
+    ho_wakeups_t w = {.n = 0};
+    int i;
+    if (n > MAX_BATCH)
+        n = MAX_BATCH;
+
+    if (!ho_download(mon, k, &V[0]))
+        return 0;
+    monitor_lock(mon);
+    for (i = 1; i < n && !mon->closed && mon->next_size != 0 && mon->next_size <= k; i++)
+        from_buffer(mon, &V[i]);
+    if (i > 1)
+        ho_dispatch(mon, &w);
+    monitor_unlock(mon);
+    ho_wake(&w);
+    return i;
+}
+
+// one node at a time, so that the vectors reach the buffer in order
+boolean ho_upload_batch(monitor_t *mon, vector_t *V, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!ho_upload(mon, &V[i]))
+            return FALSE;
+    return TRUE;
+}
+
+// queued downloaders never fit the head, so the vector is nobody else's
+boolean ho_download_nowait(monitor_t *mon, int k, vector_t *V)
+{
+    ho_wakeups_t w = {.n = 0};
+    boolean done;
+
+    monitor_lock(mon);
+    done = !mon->closed && mon->next_size != 0 && mon->next_size <= k;
+    if (done)
+    {
+        from_buffer(mon, V);
+        ho_dispatch(mon, &w);
+    }
+    monitor_unlock(mon);
+    ho_wake(&w);
+    return done;
+}
+
+boolean ho_upload_nowait(monitor_t *mon, vector_t *V)
+{
+    ho_wakeups_t w = {.n = 0};
+    boolean done;
+
+    monitor_lock(mon);
+    done = !mon->closed && mon->capacity >= size_of(V) &&
+        mon->ho_upload[0].n + mon->ho_upload[1].n + mon->ho_upload[2].n == 0;
+    if (done)
+    {
+        to_buffer(mon, V);
+        ho_dispatch(mon, &w);
+    }
+    monitor_unlock(mon);
+    ho_wake(&w);
+    return done;
+}
+
+void ho_snapshot(monitor_t *mon, FILE *f)
+{
+    volatile monitor_t *v = mon;
+
+    ring_snapshot(mon, f);
+    fprintf(f, "  queued to download: k3 %d, k5 %d, k10 %d; to upload: 3 %d, 5 %d, 10 %d; age %d %d %d\n",
+        v->ho_download[0].n, v->ho_download[1].n, v->ho_download[2].n,
+        v->ho_upload[0].n, v->ho_upload[1].n, v->ho_upload[2].n, v->age[0], v->age[1], v->age[2]);
+}
+
+// SHARDED ENGINE
+// vectors are kept in shards (-r), each with a ring per size class, so a short vector
+// never waits behind a long one and threads spread over several locks. A thread starts
+// from the shard of the CPU it runs on and moves to the others when its own has nothing
+// for it. Downloaders take the longest vectors that fit k first. The rings share one
+// capacity, the buffer size, which uploaders take with a CAS before picking a ring.
+// Waiting uploaders are woken shortest first whatever the policy.
+
+// the shard a thread starts from
+int sh_home(monitor_t *mon)
+{
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : cpu % mon->sh_shards;
+}
+
+// takes a vector of class c from the ring if there is one
+boolean sh_ring_get(sh_ring_t *r, int c, vector_t *V)
+{
+    int i, *slot;
+
+    if (atomic_load(&r->count) == 0)
+        return FALSE;
+    pthread_mutex_lock(&r->mutex);
+    if (atomic_load(&r->count) == 0)
+    {
+        pthread_mutex_unlock(&r->mutex);
+        return FALSE;
+    }
+    slot = &r->slots[r->out * class_size[c]];
+    V->size = class_size[c];
+    for (i = 0; i < V->size; i++)
+        V->data[i] = slot[i];
+    r->out = (r->out + 1) % r->n_records;
+    atomic_fetch_sub(&r->count, 1);
+    pthread_mutex_unlock(&r->mutex);
+    LOG(LOG_DEBUG, EV_DOWNLOAD, V->size, 0);
+    return TRUE;
+}
+
+// stores V in the ring; the caller holds the capacity for it, so there is room
+void sh_ring_put(sh_ring_t *r, vector_t *V)
+{
+    int i, *slot;
+
+    pthread_mutex_lock(&r->mutex);
+    slot = &r->slots[r->in * V->size];
+    for (i = 0; i < V->size; i++)
+        slot[i] = V->data[i];
+    r->in = (r->in + 1) % r->n_records;
+    atomic_fetch_add(&r->count, 1);
+    pthread_mutex_unlock(&r->mutex);
+    LOG(LOG_DEBUG, EV_UPLOAD, V->size, 0);
+}
+
+// longest class that fits k first, and within a class the home shard first
+boolean sh_try_download(monitor_t *mon, int k, vector_t *V)
+{
+    int home = sh_home(mon), c, i;
+    for (c = size_class(k); c >= 0; c--)
+        for (i = 0; i < mon->sh_shards; i++)
+            if (sh_ring_get(&mon->sh_ring[(home + i) % mon->sh_shards][c], c, V))
+            {
+                atomic_fetch_add(&mon->sh_capacity, size_of(V));
+                return TRUE;
+            }
+    return FALSE;
+}
+
+int sh_free_slots(monitor_t *mon)
+{
+    return atomic_load_explicit(&mon->sh_capacity, memory_order_relaxed);
+}
+
+void sh_snapshot(monitor_t *mon, FILE *f)
+{
+    int s, c;
+
+    fprintf(f, "  buffer: %d of %d slots used, records of 3/5/10 per shard:", mon->size - sh_free_slots(mon), mon->size);
+    for (s = 0; s < mon->sh_shards; s++)
+        fprintf(f, " %d/%d/%d", atomic_load(&mon->sh_ring[s][0].count), atomic_load(&mon->sh_ring[s][1].count),
+            atomic_load(&mon->sh_ring[s][2].count));
+    fprintf(f, "\n  waiting to download:");
+    for (c = 0; c < 3; c++)
+        fprintf(f, "%s k%d %d", c ? "," : "", class_size[c], atomic_load(&mon->sh_download[c].waiters));
+    fprintf(f, "; to upload:");
+    for (c = 0; c < 3; c++)
+        fprintf(f, "%s %d %d", c ? "," : "", class_size[c], atomic_load(&mon->sh_upload[c].waiters));
+    fprintf(f, "\n");
+}
+
+// takes the capacity for V and stores it in the home shard
+boolean sh_try_upload(monitor_t *mon, vector_t *V)
+{
+    int capacity = atomic_load(&mon->sh_capacity);
+
+    do {
+        if (capacity < size_of(V))
+            return FALSE;
+    } while (!atomic_compare_exchange_weak(&mon->sh_capacity, &capacity, capacity - size_of(V)));
+    sh_ring_put(&mon->sh_ring[sh_home(mon)][size_class(V->size)], V);
+    return TRUE;
+}
+
+// after a download: wakes as many waiting uploaders as the free space can take
+void sh_wake_uploaders(monitor_t *mon)
+{
+    int budget = atomic_load(&mon->sh_capacity), c, n;
+    for (c = 0; c < 3; c++)
+    {
+        n = atomic_load(&mon->sh_upload[c].waiters);
+        if (n > budget / (class_size[c] + 1))
+            n = budget / (class_size[c] + 1);
+        waitq_wake(&mon->sh_upload[c], n);
+        budget -= n * (class_size[c] + 1);
+    }
+}
+
+// after a vector of class c was stored: wakes a waiting downloader with the largest k
+void sh_wake_downloader(monitor_t *mon, int c)
+{
+    int kc;
+    for (kc = 2; kc >= c; kc--)
+    {
+        if (atomic_load(&mon->sh_download[kc].waiters) > 0)
+        {
+            waitq_wake(&mon->sh_download[kc], 1);
+            return;
+        }
+    }
+}
+
+// the smallest class with a vector in some shard, -1 if every ring is empty
+int sh_smallest_class(monitor_t *mon)
+{
+    int c, s;
+    for (c = 0; c < 3; c++)
+        for (s = 0; s < mon->sh_shards; s++)
+            if (atomic_load(&mon->sh_ring[s][c].count) > 0)
+                return c;
+    return -1;
+}
+
+// after a download: each upload wakes one downloader, the one with the largest k; if
+// several went to the same thread, the vectors it left may fit a smaller k still asleep
+void sh_downloaded(monitor_t *mon)
+{
+    int c = sh_smallest_class(mon);
+    if (c >= 0)
+        sh_wake_downloader(mon, c);
+    sh_wake_uploaders(mon);
+}
+
+boolean sh_download(monitor_t *mon, int k, vector_t *V)
+{
+    waitq_t *q = &mon->sh_download[size_class(k)];
+    unsigned seq;
+
+    if (atomic_load(&mon->closed))
+        return FALSE;
+    while (!sh_try_download(mon, k, V))
+    {
+        atomic_fetch_add(&q->waiters, 1);
+        seq = atomic_load(&q->seq);
+        if (sh_try_download(mon, k, V))
+        {
+            atomic_fetch_sub(&q->waiters, 1);
+            break;
+        }
+        if (atomic_load(&mon->closed))
+        {
+            atomic_fetch_sub(&q->waiters, 1);
+            return FALSE;
+        }
+        LOG_WAIT(EV_WAIT_DOWNLOAD, k);
+        spin_futex_wait(&q->seq, seq, 0);
+        n_wakeups++;
+        atomic_fetch_sub(&q->waiters, 1);
+    }
+
+    sh_downloaded(mon);
+    return TRUE;
+}
+
+boolean sh_upload(monitor_t *mon, vector_t *V)
+{
+    waitq_t *q = &mon->sh_upload[size_class(V->size)];
+    unsigned seq;
+
+    if (atomic_load(&mon->closed))
+        return FALSE;
+    while (!sh_try_upload(mon, V))
+    {
+        atomic_fetch_add(&q->waiters, 1);
+        seq = atomic_load(&q->seq);
+        if (sh_try_upload(mon, V))
+        {
+            atomic_fetch_sub(&q->waiters, 1);
+            break;
+        }
+        if (atomic_load(&mon->closed))
+        {
+            atomic_fetch_sub(&q->waiters, 1);
+            return FALSE;
+        }
+        LOG_WAIT(EV_WAIT_UPLOAD, V->size);
+        spin_futex_wait(&q->seq, seq, 1);
+        n_wakeups++;
+        atomic_fetch_sub(&q->waiters, 1);
+    }
+    sh_wake_downloader(mon, size_class(V->size));
+    return TRUE;
+}
+
+// no lock spans the whole buffer, a batch only saves the wakeups between vectors
+int sh_download_batch(monitor_t *mon, int k, vector_t *V, int n)
+{
+    int i;
+    if (n > MAX_BATCH)
+        n = MAX_BATCH;
+
+    if (!sh_download(mon, k, &V[0]))
+        return 0;
+    for (i = 1; i < n && sh_try_download(mon, k, &V[i]); i++);
+    if (i > 1)
+        sh_wake_uploaders(mon);
+    return i;
+}
+
+boolean sh_upload_batch(monitor_t *mon, vector_t *V, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        if (!sh_upload(mon, &V[i]))
+            return FALSE;
+    return TRUE;
+}
+
+boolean sh_download_nowait(monitor_t *mon, int k, vector_t *V)
+{
+    if (atomic_load(&mon->closed) || !sh_try_download(mon, k, V))
+        return FALSE;
+    sh_downloaded(mon);
+    return TRUE;
+}
+
+boolean sh_upload_nowait(monitor_t *mon, vector_t *V)
+{
+    if (atomic_load(&mon->closed) || !sh_try_upload(mon, V))
+        return FALSE;
+    sh_wake_downloader(mon, size_class(V->size));
+    return TRUE;
+}
+
+// UPLOAD POLICIES
+// SVF, LVF and aging queue uploaders per size class and differ only in whom they wake;
+// FVF queues them in arrival order
+
+// mutex engine: waits on the condition variable of V's size class
+void class_wait_upload(monitor_t *mon, vector_t *V)
+{
+    while(!mon->closed && mon->capacity < size_of(V))
+    {
+        LOG_WAIT(EV_WAIT_UPLOAD, V->size);
+        if (V->size == 10)
+        {
+            mon->n_u10++;
+            monitor_wait(mon, &mon->can_upload10, 1);
+            n_wakeups++;
+            mon->n_u10--;
+        }
+        else if (V->size == 5)
+        {
+            mon->n_u5++;
+            monitor_wait(mon, &mon->can_upload5, 1);
+            n_wakeups++;
+            mon->n_u5--;
+        }
+        else if (V->size == 3)
+        {
+            mon->n_u3++;
+            monitor_wait(mon, &mon->can_upload3, 1);
+            n_wakeups++;
+            mon->n_u3--;
+        }
+    }
+}
+
+// mutex engine: queues the thread in arrival order and waits on its own condition
+// variable until it is at the head and V fits; then hands the turn to the next one.
+// Nodes live on the waiters' stacks, so any number of threads can queue
+void fvf_wait_upload(monitor_t *mon, vector_t *V)
+{
+    fvf_node_t node = {.next = NULL};
+
+    if (mon->closed || (mon->n_u == 0 && mon->capacity >= size_of(V)))
+        return;
+    pthread_cond_init(&node.cond, NULL);
+    mon->n_u ++;
+    if (mon->fvf_tail != NULL)
+        mon->fvf_tail->next = &node;
+    else
+        mon->fvf_head = &node;
+    mon->fvf_tail = &node;
+    while(!mon->closed && (mon->fvf_head != &node || mon->capacity < size_of(V)))
+    {
+        LOG_WAIT(EV_WAIT_UPLOAD, V->size);
+        monitor_wait(mon, &node.cond, 1);
+        n_wakeups++;
+    }
+    if (mon->closed) // monitor_close emptied the queue
+    {
+        pthread_cond_destroy(&node.cond);
+        return;
+    }
+    mon->n_u --;
+    mon->fvf_head = node.next;
+    if (mon->fvf_head == NULL)
+        mon->fvf_tail = NULL;
+    pthread_cond_destroy(&node.cond);
+    // the next in line checks whether it fits once V is in the buffer. The new head is a
+    // change too, or a thread spinning in monitor_wait would not see that it is its turn
+    if (mon->fvf_head != NULL)
+    {
+        ring_changed(mon);
+        pthread_cond_signal(&mon->fvf_head->cond);
+    }
+}
+
+// Shortest Vector First to upload
+void svf_signal_upload(monitor_t *mon)
+{
+    if (mon->n_u3 > 0 && mon->capacity >= 3)
+    {
+        pthread_cond_signal(&mon->can_upload3);
+    }
+    else if (mon->n_u5 > 0 && mon->capacity >= 5)
+    {
+        pthread_cond_signal(&mon->can_upload5);
+    }
+    else if (mon->n_u10 > 0  && mon->capacity >= 10)
+    {
+        pthread_cond_signal(&mon->can_upload10);
+    }
+}
+
+// Longest Vector First to upload
+void lvf_signal_upload(monitor_t *mon)
+{
+    if (mon->n_u10 > 0 && mon->capacity >= 10)
+    {
+        pthread_cond_signal(&mon->can_upload10);
+    }
+    else if (mon->n_u5 > 0 && mon->capacity >= 5)
+    {
+        pthread_cond_signal(&mon->can_upload5);
+    }
+    else if (mon->n_u3 > 0 && mon->capacity >= 3)
+    {
+        pthread_cond_signal(&mon->can_upload3);
+    }
+}
+
+// First Come First Served to upload
+void fvf_signal_upload(monitor_t *mon)
+{
+    if (mon->fvf_head != NULL)
+    {
+        pthread_cond_signal(&mon->fvf_head->cond);
+    }
+}
+
+// chooses the size class to wake under the aging policy: shortest first, unless a class
+// was passed over AGING_LIMIT times, in which case nobody else goes until it fits;
+// returns -1 if nobody should be woken
+int aging_choose(int waiting[3], int age[3], int capacity)
+{
+    int c;
+    for (c = 2; c >= 0; c--)
+        if (waiting[c] > 0 && age[c] >= AGING_LIMIT)
+            return capacity >= class_size[c] + 1 ? c : -1;
+    for (c = 0; c < 3; c++)
+        if (waiting[c] > 0 && capacity >= class_size[c] + 1)
+            return c;
+    return -1;
+}
+
+// Shortest Vector First with aging, so that long vectors are not starved
+void aging_signal_upload(monitor_t *mon)
+{
+    int waiting[3] = {mon->n_u3, mon->n_u5, mon->n_u10};
+    pthread_cond_t *can_upload[3] = {&mon->can_upload3, &mon->can_upload5, &mon->can_upload10};
+    int c, chosen = aging_choose(waiting, mon->age, mon->capacity);
+
+    if (chosen < 0)
+        return;
+    pthread_cond_signal(can_upload[chosen]);
+    for (c = 0; c < 3; c++)
+    {
+        if (c == chosen)
+            mon->age[c] = 0;
+        else if (waiting[c] > 0)
+            mon->age[c]++;
+    }
+}
+
+// lock-free engine: sleeps in V's size class until there is room
+int_fast64_t lf_class_reserve(monitor_t *mon, vector_t *V)
+{
+    waitq_t *q = &mon->lf_upload[size_class(V->size)];
+    int_fast64_t pos;
+    unsigned seq;
+
+    while((pos = lf_try_reserve(mon, size_of(V))) < 0) {
+        atomic_fetch_add(&q->waiters, 1);
+        seq = atomic_load(&q->seq);
+        if((pos = lf_try_reserve(mon, size_of(V))) >= 0) {
+            atomic_fetch_sub(&q->waiters, 1);
+            break;
+        }
+        if(atomic_load(&mon->closed)) {
+            atomic_fetch_sub(&q->waiters, 1);
+            return -1;
+        }
+        LOG_WAIT(EV_WAIT_UPLOAD, V->size);
+        spin_futex_wait(&q->seq, seq, 1);
+        n_wakeups++;
+        atomic_fetch_sub(&q->waiters, 1);
+    }
+    return pos;
+}
+
+// lock-free engine: takes a ticket and sleeps until it is served and there is room
+int_fast64_t lf_fvf_reserve(monitor_t *mon, vector_t *V)
+{
+    waitq_t *q = &mon->lf_fvf;
+    int_fast64_t pos = -1;
+    unsigned seq, ticket;
+
+    // barge only if nobody is queued
+    if(atomic_load(&mon->lf_ticket) == atomic_load(&mon->lf_serving))
+        pos = lf_try_reserve(mon, size_of(V));
+    if(pos >= 0)
+        return pos;
+
+    ticket = atomic_fetch_add(&mon->lf_ticket, 1);
+    for(;;) {
+        if(atomic_load(&mon->lf_serving) == ticket && (pos = lf_try_reserve(mon, size_of(V))) >= 0)
+            break;
+        atomic_fetch_add(&q->waiters, 1);
+        seq = atomic_load(&q->seq);
+        if(atomic_load(&mon->lf_serving) == ticket && (pos = lf_try_reserve(mon, size_of(V))) >= 0) {
+            atomic_fetch_sub(&q->waiters, 1);
+            break;
+        }
+        if(atomic_load(&mon->closed)) {
+            atomic_fetch_sub(&q->waiters, 1);
+            return -1;
+        }
+        LOG_WAIT(EV_WAIT_UPLOAD, V->size);
+        spin_futex_wait(&q->seq, seq, 1);
+        n_wakeups++;
+        atomic_fetch_sub(&q->waiters, 1);
+    }
+    atomic_fetch_add(&mon->lf_serving, 1);
+    lf_fvf_wake_upload(mon); // next ticket
+    return pos;
+}
+
+// lock-free engine: wakes as many uploaders as the free space can take, classes in the given order
+void lf_wake_in_order(monitor_t *mon, const int order[3])
+{
+    int budget = lf_capacity(mon), i, c, n;
+    for(i = 0; i < 3; i++) {
+        c = order[i];
+        n = atomic_load(&mon->lf_upload[c].waiters);
+        if(n > budget / (class_size[c] + 1))
+            n = budget / (class_size[c] + 1);
+        waitq_wake(&mon->lf_upload[c], n);
+        budget -= n * (class_size[c] + 1);
+    }
+}
+
+void lf_svf_wake_upload(monitor_t *mon)
+{
+    static const int order[3] = {0, 1, 2};
+    lf_wake_in_order(mon, order);
+}
+
+void lf_lvf_wake_upload(monitor_t *mon)
+{
+    static const int order[3] = {2, 1, 0};
+    lf_wake_in_order(mon, order);
+}
+
+void lf_fvf_wake_upload(monitor_t *mon)
+{
+    // only the thread holding the next ticket may go, let the queue recheck
+    if(atomic_load(&mon->lf_ticket) != atomic_load(&mon->lf_serving))
+        waitq_wake(&mon->lf_fvf, INT_MAX);
+}
+
+void lf_aging_wake_upload(monitor_t *mon)
+{
+    int waiting[3], age[3], c, chosen;
+    for(c = 0; c < 3; c++) {
+        waiting[c] = atomic_load(&mon->lf_upload[c].waiters);
+        age[c] = atomic_load(&mon->lf_age[c]);
+    }
+    chosen = aging_choose(waiting, age, lf_capacity(mon));
+    if(chosen < 0)
+        return;
+    waitq_wake(&mon->lf_upload[chosen], 1);
+    for(c = 0; c < 3; c++) {
+        if(c == chosen)
+            atomic_store(&mon->lf_age[c], 0);
+        else if(waiting[c] > 0)
+            atomic_fetch_add(&mon->lf_age[c], 1);
+    }
+}
+
+// handoff engine: first queued class in the given order whose head fits
+int ho_pick_in_order(monitor_t *mon, const int order[3])
+{
+    int i, c;
+    for (i = 0; i < 3; i++) {
+        c = order[i];
+        if (mon->ho_upload[c].n > 0 && mon->capacity >= class_size[c] + 1)
+            return c;
+    }
+    return -1;
+}
+
+int ho_svf_pick_upload(monitor_t *mon)
+{
+    static const int order[3] = {0, 1, 2};
+    return ho_pick_in_order(mon, order);
+}
+
+int ho_lvf_pick_upload(monitor_t *mon)
+{
+    static const int order[3] = {2, 1, 0};
+    return ho_pick_in_order(mon, order);
+}
+
+// the oldest queued uploader, and nobody else until it fits
+int ho_fvf_pick_upload(monitor_t *mon)
+{
+    int c, oldest = -1;
+    for (c = 0; c < 3; c++)
+        if (mon->ho_upload[c].n > 0 && (oldest < 0 || mon->ho_upload[c].head->arrival < mon->ho_upload[oldest].head->arrival))
+            oldest = c;
+    if (oldest < 0 || mon->capacity < class_size[oldest] + 1)
+        return -1;
+    return oldest;
+}
+
+int ho_aging_pick_upload(monitor_t *mon)
+{
+    int waiting[3] = {mon->ho_upload[0].n, mon->ho_upload[1].n, mon->ho_upload[2].n};
+    int c, chosen = aging_choose(waiting, mon->age, mon->capacity);
+
+    if (chosen < 0)
+        return -1;
+    for (c = 0; c < 3; c++)
+    {
+        if (c == chosen)
+            mon->age[c] = 0;
+        else if (waiting[c] > 0)
+            mon->age[c]++;
+    }
+    return chosen;
+}
+
+// allocates the ring for size slots. The ring is rounded up to a power of two of at
+// least a page, and a memfd of that length is mapped twice, back to back, in a range
+// reserved at once so nothing else can land between the two views. Without memfd the
+// ring is plain memory and spans wrap. Either way a few slots past a record can be
+// read (the kernels load whole registers), so reads never leave the mapping
+void ring_map(monitor_t *mon, int size)
+{
+    long page = sysconf(_SC_PAGESIZE) / sizeof(int);
+    size_t len;
+    char *base;
+    int fd;
+
+    for (mon->mask = 1; mon->mask < size || mon->mask < page; mon->mask <<= 1);
+    len = mon->mask * sizeof(int);
+    mon->mask--;
+
+    fd = memfd_create("A2-ring", MFD_CLOEXEC);
+    if (fd >= 0 && ftruncate(fd, len) == 0)
+    {
+        base = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base != MAP_FAILED)
+        {
+            if (mmap(base, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED &&
+                mmap(base + len, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) != MAP_FAILED)
+            {
+                close(fd);
+                mon->buffer = (int *)base;
+                mon->mirrored = TRUE;
+                mon->map_len = 2 * len;
+                return;
+            }
+            munmap(base, 2 * len);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    mon->mirrored = FALSE;
+    mon->map_len = len + 2 * sizeof(vector_t);
+    mon->buffer = calloc(1, mon->map_len);
+    if (mon->buffer == NULL)
+    {
+        fprintf(stderr, "Cannot allocate a buffer of %d slots\n", size);
+        exit(1);
+    }
+}
+
+void ring_unmap(monitor_t *mon)
+{
+    if (mon->mirrored)
+        munmap(mon->buffer, mon->map_len);
+    else
+        free(mon->buffer);
+}
+
+// in real-time mode a thread holding a monitor mutex inherits the priority of the
+// highest thread waiting for it, so a low priority holder preempted by a medium one
+// cannot block the high priority waiter for long
+void monitor_mutex_init(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    if (rt)
+        pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void monitor_init(monitor_t *mon, const engine_t *engine, const policy_t *policy, int size)
+{
+    // initialization of tools commmon to all policies
+    monitor_mutex_init(&mon->mutex);
+    pthread_cond_init(&mon->can_download3, NULL);
+    pthread_cond_init(&mon->can_download5, NULL);
+    pthread_cond_init(&mon->can_download10, NULL);
+    mon->n_d3 = 0;
+    mon->n_d5 = 0;
+    mon->n_d10 = 0;
+
+
+    // for SVF and LVF
     pthread_cond_init(&mon->can_upload3, NULL);
     pthread_cond_init(&mon->can_upload5, NULL);
     pthread_cond_init(&mon->can_upload10, NULL);
@@ -418,18 +2843,142 @@ void monitor_init(monitor_t *mon)
     mon->n_u10 = 0;
 
     // for FVF
-    for (int i = 0; i < N_THREADS; i++)
+    mon->fvf_head = mon->fvf_tail = NULL;
+    mon->n_u = 0;
+
+    // for aging
+    for (int i = 0; i < 3; i++)
     {
-        pthread_cond_init(&mon->can_upload[i], NULL);
+        mon->age[i] = 0;
     }
-    mon->index_served = 0;
-    mon->index_in = -1;
-    mon->n_u = 0;
 
     mon->in = 0;
     mon->out = 0;
+    mon->claim = 0;
+    mon->pub = 0;
+    mon->claimed = mon->avail = mon->reserved = 0;
     mon->next_size = 0;
-    mon->capacity = BUFFER_SIZE;
+    mon->size = size;
+    ring_map(mon, size);
+    mon->done = calloc(mon->mask + 1, 1);
+    if (mon->done == NULL)
+    {
+        fprintf(stderr, "Cannot allocate a buffer of %d slots\n", size);
+        exit(1);
+    }
+    mon->capacity = size;
+    atomic_init(&mon->closed, 0);
+    atomic_init(&mon->changes, 0);
+
+    // for the lock-free engine
+    atomic_init(&mon->lf_in, 0);
+    atomic_init(&mon->lf_out, 0);
+    mon->lf_tag = NULL;
+    if (engine->download == lf_download)
+    {
+        mon->lf_tag = malloc((size_t)(mon->mask + 1) * sizeof(atomic_uint_fast64_t));
+        if (mon->lf_tag == NULL)
+        {
+            fprintf(stderr, "Cannot allocate the tags of %d slots\n", size);
+            exit(1);
+        }
+        for (int i = 0; i <= mon->mask; i++)
+        {
+            atomic_init(&mon->lf_tag[i], 0);
+        }
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        waitq_init(&mon->lf_download[i]);
+        waitq_init(&mon->lf_upload[i]);
+    }
+    waitq_init(&mon->lf_fvf);
+    atomic_init(&mon->lf_ticket, 0);
+    atomic_init(&mon->lf_serving, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        atomic_init(&mon->lf_age[i], 0);
+    }
+
+    // for the handoff engine
+    for (int i = 0; i < 3; i++)
+    {
+        mon->ho_download[i].head = mon->ho_download[i].tail = NULL;
+        mon->ho_download[i].n = 0;
+        mon->ho_upload[i].head = mon->ho_upload[i].tail = NULL;
+        mon->ho_upload[i].n = 0;
+    }
+    mon->ho_arrival = 0;
+
+    // for the sharded engine; its rings take as much again as the buffer per shard,
+    // so they are only allocated when it runs
+    mon->sh_shards = engine->download == sh_download ? shards : 0;
+    for (int s = 0; s < mon->sh_shards; s++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            sh_ring_t *r = &mon->sh_ring[s][c];
+            monitor_mutex_init(&r->mutex);
+            r->n_records = size / (class_size[c] + 1);
+            r->slots = malloc((size_t)r->n_records * class_size[c] * sizeof(int));
+            if (r->slots == NULL)
+            {
+                fprintf(stderr, "Cannot allocate the rings of %d shards of %d slots\n", shards, size);
+                exit(1);
+            }
+            r->in = r->out = 0;
+            atomic_init(&r->count, 0);
+        }
+    }
+    atomic_init(&mon->sh_capacity, size);
+    for (int i = 0; i < 3; i++)
+    {
+        waitq_init(&mon->sh_download[i]);
+        waitq_init(&mon->sh_upload[i]);
+    }
+
+    mon->engine = engine;
+    mon->policy = policy;
+}
+
+// wakes up every blocked thread; from now on download and upload fail
+void monitor_close(monitor_t *mon)
+{
+    monitor_lock(mon);
+    atomic_store(&mon->closed, 1);
+    ring_changed(mon);
+    pthread_cond_broadcast(&mon->can_download3);
+    pthread_cond_broadcast(&mon->can_download5);
+    pthread_cond_broadcast(&mon->can_download10);
+    pthread_cond_broadcast(&mon->can_upload3);
+    pthread_cond_broadcast(&mon->can_upload5);
+    pthread_cond_broadcast(&mon->can_upload10);
+    for (fvf_node_t *node = mon->fvf_head; node != NULL; node = node->next)
+    {
+        pthread_cond_broadcast(&node->cond);
+    }
+    mon->fvf_head = mon->fvf_tail = NULL;
+    mon->n_u = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        while (mon->ho_download[i].n > 0)
+            ho_grant(ho_pop(&mon->ho_download[i]), HO_CLOSED, NULL);
+        while (mon->ho_upload[i].n > 0)
+            ho_grant(ho_pop(&mon->ho_upload[i]), HO_CLOSED, NULL);
+    }
+    monitor_unlock(mon);
+
+    for (int i = 0; i < 3; i++)
+    {
+        waitq_wake(&mon->lf_download[i], INT_MAX);
+        waitq_wake(&mon->lf_upload[i], INT_MAX);
+    }
+    waitq_wake(&mon->lf_fvf, INT_MAX);
+    for (int i = 0; i < 3; i++)
+    {
+        waitq_wake(&mon->sh_download[i], INT_MAX);
+        waitq_wake(&mon->sh_upload[i], INT_MAX);
+    }
 }
 
 void monitor_destroy(monitor_t *mon) 
@@ -444,81 +2993,1428 @@ void monitor_destroy(monitor_t *mon)
     pthread_cond_destroy(&mon->can_download5);
     pthread_cond_destroy(&mon->can_download10);
 
-    // for FVF
-    pthread_cond_destroy(&mon->can_upload[N_THREADS]);
-    pthread_cond_destroy(&mon->can_download3);
-    pthread_cond_destroy(&mon->can_download5);
-    pthread_cond_destroy(&mon->can_download10);  
-}
+    // for the sharded engine
+    for (int s = 0; s < mon->sh_shards; s++)
+    {
+        for (int c = 0; c < 3; c++)
+        {
+            pthread_mutex_destroy(&mon->sh_ring[s][c].mutex);
+            free(mon->sh_ring[s][c].slots);
+        }
+    }
+
+    ring_unmap(mon);
+    free(mon->done);
+    free(mon->lf_tag);
+}
+
+// MAIN FUNCTION
+int main(int argc, char *argv[]) {
+    const engine_t *engine = &engines[0];
+    const policy_t *policy = &policies[0];
+    int i, opt, size = BUFFER_SIZE, level = -1, n_workers = N_THREADS;
+    boolean bench = FALSE, selftest = FALSE;
+    const char *levels[] = {"off", "error", "info", "debug"}, *trace = NULL, *metrics_path = NULL;
+    const char *shapes = NULL, *config = NULL;
+    char *bench_engines = "mutex,lockfree,handoff,sharded", *bench_policies = "svf,lvf,fvf,aging";
+    char *bench_threads = "4,15", *bench_sizes = "30", *bench_mixes = "1:1:1";
+
+    // command line: -e <engine> selects the buffer engine, -p <policy> the upload policy,
+    // -b <n> makes threads move up to n vectors per monitor call, -k <kernels> selects
+    // the multiply kernels (the best the CPU supports by default), -m int|packed the matrix format, -z multiplies in place in the buffer,
+    // -s <n> the buffer size, -r <n> the shards of the sharded engine, -l <level> the log level (debug by default, off in benchmark mode),
+    // -o <file> the trace file and -f text|binary its format, -R <n> the seed, -F the real-time mode, -U <path> the socket
+    // serving metrics; -w <n> sets the number of workers, -x <KxO,...> their shapes and
+    // -c <file> reads both from a file (see EXECUTOR); -D <ms> starts the watchdog and -A
+    // sets what it does on a stall (see WATCHDOG); -B runs the benchmark instead
+    // (see BENCHMARK MODE) and -K checks the multiply kernels (see KERNEL SELF-TEST)
+    while ((opt = getopt(argc, argv, "e:p:b:k:m:zs:r:l:o:f:R:FU:w:x:c:D:A:Bn:E:P:T:S:X:K")) != -1) {
+        if (opt == 'e') {
+            for (i = 0; i < N_ENGINES && strcmp(optarg, engines[i].name) != 0; i++);
+            if (i == N_ENGINES) {
+                fprintf(stderr, "Unknown engine %s\n", optarg);
+                exit(1);
+            }
+            engine = &engines[i];
+        }
+        else if (opt == 'p') {
+            for (i = 0; i < N_POLICIES && strcmp(optarg, policies[i].name) != 0; i++);
+            if (i == N_POLICIES) {
+                fprintf(stderr, "Unknown policy %s\n", optarg);
+                exit(1);
+            }
+            policy = &policies[i];
+        }
+        else if (opt == 'b' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_BATCH) {
+            batch = atoi(optarg);
+        }
+        else if (opt == 'k') {
+            if (!kernels_init(optarg)) {
+                fprintf(stderr, "Kernels %s not available\n", optarg);
+                exit(1);
+            }
+        }
+        else if (opt == 'm' && (strcmp(optarg, "int") == 0 || strcmp(optarg, "packed") == 0)) {
+            packed = strcmp(optarg, "packed") == 0;
+        }
+        else if (opt == 'z') {
+            zerocopy = TRUE;
+        }
+        else if (opt == 's' && atoi(optarg) >= 11 && atoi(optarg) <= MAX_BUFFER_SIZE) {
+            size = atoi(optarg);
+        }
+        else if (opt == 'r' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_SHARDS) {
+            shards = atoi(optarg);
+        }
+        else if (opt == 'l') {
+            for (level = 0; level <= LOG_DEBUG && strcmp(optarg, levels[level]) != 0; level++);
+            if (level > LOG_DEBUG) {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                exit(1);
+            }
+        }
+        else if (opt == 'o') {
+            trace = optarg;
+        }
+        else if (opt == 'f' && (strcmp(optarg, "text") == 0 || strcmp(optarg, "binary") == 0)) {
+            log_binary = strcmp(optarg, "binary") == 0;
+        }
+        else if (opt == 'B') {
+            bench = TRUE;
+        }
+        else if (opt == 'K') {
+            selftest = TRUE;
+        }
+        else if (opt == 'n' && atol(optarg) > 0) {
+            bench_iterations = atol(optarg);
+        }
+        else if (opt == 'E') {
+            bench_engines = optarg;
+        }
+        else if (opt == 'P') {
+            bench_policies = optarg;
+        }
+        else if (opt == 'T') {
+            bench_threads = optarg;
+        }
+        else if (opt == 'S') {
+            bench_sizes = optarg;
+        }
+        else if (opt == 'X') {
+            bench_mixes = optarg;
+        }
+        else if (opt == 'R') {
+            seed = strtoull(optarg, NULL, 0);
+        }
+        else if (opt == 'F') {
+            rt = TRUE;
+        }
+        else if (opt == 'U') {
+            metrics_path = optarg;
+        }
+        else if (opt == 'w' && atoi(optarg) >= 0 && atoi(optarg) <= MAX_THREADS) {
+            n_workers = atoi(optarg);
+        }
+        else if (opt == 'x') {
+            shapes = optarg;
+        }
+        else if (opt == 'c') {
+            config = optarg;
+        }
+        else if (opt == 'D' && atoi(optarg) > 0) {
+            watchdog_ms = atoi(optarg);
+        }
+        else if (opt == 'A') {
+            for (watchdog_action = WATCHDOG_REPORT; watchdog_action <= WATCHDOG_CLOSE && strcmp(optarg, watchdog_actions[watchdog_action]) != 0; watchdog_action++);
+            if (watchdog_action > WATCHDOG_CLOSE) {
+                fprintf(stderr, "Unknown watchdog action %s\n", optarg);
+                exit(1);
+            }
+        }
+        else {
+            fprintf(stderr, "Usage: %s [-e mutex|lockfree|handoff|sharded] [-p svf|lvf|fvf|aging] [-b 1..%d] [-k avx2|sse4.1|scalar|generic] [-m packed|int] [-z] [-s 11..%d]\n"
+                "       %*s [-r 1..%d] [-l off|error|info|debug] [-o trace] [-f text|binary] [-R seed] [-F] [-U socket]\n"
+                "       %*s [-w 0..%d] [-x KxO,...] [-c config] [-D ms] [-A report|unjam|close]\n"
+                "       %s -B [-n ops] [-E engines] [-P policies] [-T threads] [-S sizes] [-X mixes] [-k ...] [-m ...] [-z]\n"
+                "       %s -K [-R seed]\n",
+                argv[0], MAX_BATCH, MAX_BUFFER_SIZE, (int)strlen(argv[0]), "", MAX_SHARDS, (int)strlen(argv[0]), "", MAX_THREADS, argv[0], argv[0]);
+            exit(1);
+        }
+    }
+
+    if (kernels == NULL)
+        kernels_init(NULL);
+    if (selftest) {
+        rng_seed(&rng, seed, 0);
+        return kernels_selftest() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    log_level = level >= 0 ? level : (bench ? LOG_OFF : LOG_DEBUG);
+    if (!bench)
+        metrics_start(metrics_path); // before any other thread, which must not take SIGUSR2
+    spin_init();
+    log_start(trace);
+
+    if (bench) {
+        rng_seed(&rng, seed, 0);
+        bench_main(bench_engines, bench_policies, bench_threads, bench_sizes, bench_mixes);
+        log_stop();
+        return EXIT_SUCCESS;
+    }
 
-// MAIN FUNCTION
-int main(void) {
-    // thread management data structures
-    pthread_t my_threads[N_THREADS];
-    thread_name_t my_thread_names[N_THREADS];
-    int i;
+    if (rt)
+        rt_init();
+    track_calls = rt || watchdog_ms > 0;
 
     // initialize monitor data structure before creating the threads
-    srand(42);
-	monitor_init(&mon);
+    rng_seed(&rng, seed, 0);
+	monitor_init(&mon, engine, policy, size);
+	printf("Using %s engine, %s policy, %s kernels on %s matrices\n", engine->name, policy->name, kernels->name, packed ? "packed" : "int");
 	// printf("Monitor sanity checked %s\n", sanity_check(&mon)?"passed":"failed");
 	show_buffer(&mon);
+	if (watchdog_ms > 0)
+		watchdog_start();
 
-	printf("Creating %d threads...\n", N_THREADS);
+	printf("Creating %d threads...\n", executor_start(n_workers, shapes, config));
 
-    for (i=0;i<N_THREADS;i++) {
-     	sprintf(my_thread_names[i],"t%d",i);
-        // create N_THREADS thread with same entry point 
-        // these threads are distinguishable thanks to their argument (their name: "t1", "t2", ...)
-        // thread names can also be used inside threads to show output messages
-        pthread_create(&my_threads[i], NULL, thread, my_thread_names[i]);
-    }
-
-    for (i=0;i<N_THREADS;i++) {
-        pthread_join(my_threads[i], NULL);
-    }
+    // workers join and leave on commands from stdin; once it ends, wait for them
+    executor_run();
 	// printf("Monitor sanity checked %s\n", sanity_check(&mon)?"passed":"failed");
 
 
     // free OS resources occupied by the monitor after creating the threads
     monitor_destroy(&mon);
+    log_stop();
 
     return EXIT_SUCCESS;
 }
 
 // THREAD LOOP
+// with -b each step moves up to batch vectors per monitor call
 void *thread(void *arg) {
 	// local variables definition and initialization
-	char *name=(char *)arg;
+	worker_t *w=(worker_t *)arg;
+	char *name=w->name;
+	int id=w-workers;
 	// int iterations_left=MAX_ITERATIONS;
-	vector_t Vin, Vout; // working vector
-	int k=rand_size(),o=rand_size();
+	vector_t Vin[MAX_BATCH], Vout[MAX_BATCH]; // working vectors
+	int k,o,i,n;
+	boolean done;
 	matrix_t M;
+	packed_matrix_t P;
 
+	rng_seed(&rng,seed,1+id);
+	log_ring=w->ring;
+	metrics_self=w->slot;
+	k=w->k?w->k:rand_size();
+	o=w->o?w->o:rand_size();
+	call_thread_start(id,k);
 	init_matrix(&M,k,o); // initialize matrix, with k rows and o columns
+	pack_matrix(&P,&M);
 	show_matrix(&M);
 
-	printf("Thread %s started.\n", name);
-	FOREVER { // or any number of times
-		download(&mon,k,&Vin);
-		//printf("Thread %s downloaded ", name); show_vector(&Vin);
-		multiply(&M,&Vin,&Vout);
-		//printf("Thread %s obtained ", name); show_vector(&Vout);
-		upload(&mon,&Vout);
+	if(batch>1)
+		printf("Thread %s started (batches of %d).\n", name, batch);
+	else
+		printf("Thread %s started.\n", name);
+	while(!atomic_load_explicit(&w->leave,memory_order_relaxed)) { // until it is told to leave
+		if(zerocopy && batch==1) {
+			if(track_calls) // the whole step, like in benchmark mode
+				call_enter(EV_DOWNLOAD,k);
+			done=zerocopy_step(&mon,k,&M,&P);
+			if(track_calls)
+				call_leave();
+			if(!done)
+				break; // the monitor was closed
+			spend_some_time(MIN_LOOPS+rng_below(&rng,WAIT_LOOPS+1));
+			continue;
+		}
+		if(track_calls)
+			call_enter(EV_DOWNLOAD,k);
+		if(batch>1)
+			n=download_batch(&mon,k,Vin,batch);
+		else
+			n=download(&mon,k,Vin)?1:0;
+		if(track_calls)
+			call_leave();
+		if(n==0)
+			break; // the monitor was closed
+		//printf("Thread %s downloaded ", name); show_vector(&Vin[0]);
+		for(i=0;i<n;i++) {
+			if(packed)
+				packed_multiply(&P,&Vin[i],&Vout[i]);
+			else
+				fast_multiply(&M,&Vin[i],&Vout[i]);
+		}
+		//printf("Thread %s obtained ", name); show_vector(&Vout[0]);
+		if(track_calls)
+			call_enter(EV_UPLOAD,o);
+		if(batch>1)
+			done=upload_batch(&mon,Vout,n);
+		else
+			done=upload(&mon,Vout);
+		if(track_calls)
+			call_leave();
+		if(!done)
+			break;
 		//printf("Thread %s updated buffer. ", name);
 		//printf("Monitor sanity checked %s\n", sanity_check(&mon)?"passed":"failed");
 		//show_buffer(&mon);
-		spend_some_time(MIN_LOOPS+rand()%(WAIT_LOOPS+1)); // optionally, to add some randomness and slow down output
+		spend_some_time(MIN_LOOPS+rng_below(&rng,WAIT_LOOPS+1)); // optionally, to add some randomness and slow down output
 	}
 	printf("Thread %s finished.\n", name);
+	call_thread_stop();
+	w->ring=log_ring;
+	w->slot=metrics_self;
+	atomic_store(&w->finished,1);
 
 	pthread_exit(NULL);
 }
 
+// EXECUTOR
+// the thread loop runs on a pool of workers. -w sets how many start and -x their shapes,
+// "KxO" for a worker that downloads vectors up to K and uploads vectors of size O, cycled
+// over the workers; -c reads one worker per line from a file instead ("KxO" or "random",
+// '#' starts a comment). Workers are numbered by the lowest free slot of workers[], so a
+// worker's id, name, random stream and real-time CPU stay below MAX_THREADS. Main then
+// reads commands from stdin:
+//   join [KxO]  starts a worker, of random shape if none is given
+//   leave [tN]  stops worker tN, the newest one by default
+//   list        prints the workers
+// Leaving is cooperative: a worker checks its flag between steps, so one blocked in the
+// monitor leaves once it is served. Workers that have finished are joined as commands
+// arrive, and at the end of the input main waits for the rest
+
+// "KxO" or "random" (k=o=0) at the start of s, ended by a comma, a space or the end
+boolean executor_shape(const char *s, int *k, int *o) {
+	int len=6;
+	if(strncmp(s,"random",6)==0)
+		*k=*o=0;
+	else if(sscanf(s,"%dx%d%n",k,o,&len)!=2 || class_size[size_class(*k)]!=*k || class_size[size_class(*o)]!=*o)
+		return FALSE;
+	return s[len]=='\0' || s[len]==',' || isspace((unsigned char)s[len]);
+}
+
+// id of the new worker, -1 if none can start
+int executor_join(int k, int o) {
+	worker_t *w;
+	pthread_attr_t attr;
+	int i;
+
+	for(i=0;i<MAX_THREADS && workers[i].alive;i++);
+	if(i==MAX_THREADS) {
+		printf("No room for another worker (at most %d).\n", MAX_THREADS);
+		return -1;
+	}
+	w=&workers[i];
+	sprintf(w->name,"t%d",i);
+	w->k=k;
+	w->o=o;
+	atomic_store(&w->leave,0);
+	atomic_store(&w->finished,0);
+	if(rt)
+		rt_thread_attr(&attr,i);
+	errno=pthread_create(&w->tid,rt?&attr:NULL,thread,w);
+	if(rt)
+		pthread_attr_destroy(&attr);
+	if(errno!=0) {
+		perror(rt?"Cannot create a SCHED_FIFO thread (needs CAP_SYS_NICE or RLIMIT_RTPRIO)":"Cannot create a thread");
+		return -1;
+	}
+	w->alive=TRUE;
+	return i;
+}
+
+// joins the workers that have finished, or all of them if wait
+void executor_reap(boolean wait) {
+	for(int i=0;i<MAX_THREADS;i++)
+		if(workers[i].alive && (wait || atomic_load(&workers[i].finished))) {
+			pthread_join(workers[i].tid,NULL);
+			workers[i].alive=FALSE;
+		}
+}
+
+// starts n workers with shapes cycled from the list, or the ones of the config file;
+// returns how many started
+int executor_start(int n, const char *shapes, const char *config) {
+	char line[256], *p;
+	int k[MAX_THREADS], o[MAX_THREADS], n_shapes=0, i, started=0;
+	FILE *f;
+
+	if(config!=NULL) {
+		if((f=fopen(config,"r"))==NULL) {
+			perror(config);
+			exit(1);
+		}
+		for(n=0, i=1; fgets(line,sizeof(line),f)!=NULL; i++) {
+			if((p=strchr(line,'#'))!=NULL)
+				*p='\0';
+			for(p=line; isspace((unsigned char)*p); p++);
+			if(*p=='\0')
+				continue;
+			if(n==MAX_THREADS || !executor_shape(p,&k[n],&o[n])) {
+				fprintf(stderr, n==MAX_THREADS?"%s:%d: more than %d workers\n":"%s:%d: expected KxO or random\n", config, i, MAX_THREADS);
+				exit(1);
+			}
+			n++;
+		}
+		fclose(f);
+		n_shapes=n;
+	}
+	else if(shapes!=NULL) {
+		for(p=(char *)shapes; n_shapes<MAX_THREADS; p++) {
+			if(!executor_shape(p,&k[n_shapes],&o[n_shapes])) {
+				fprintf(stderr, "Bad worker shape in %s, expected KxO with K and O in 3, 5, 10\n", shapes);
+				exit(1);
+			}
+			n_shapes++;
+			if((p=strchr(p,','))==NULL)
+				break;
+		}
+	}
+	for(i=0;i<n;i++)
+		if(executor_join(n_shapes?k[i%n_shapes]:0,n_shapes?o[i%n_shapes]:0)>=0)
+			started++;
+	return started;
+}
+
+void executor_list(void) {
+	for(int i=0;i<MAX_THREADS;i++)
+		if(workers[i].alive) {
+			printf("%s", workers[i].name);
+			if(workers[i].k)
+				printf(" %dx%d", workers[i].k, workers[i].o);
+			else
+				printf(" random");
+			printf("%s\n", atomic_load(&workers[i].finished)?" finished":atomic_load(&workers[i].leave)?" leaving":"");
+		}
+	fflush(stdout);
+}
+
+// reads commands until the end of stdin, then waits for the workers. In real-time mode
+// it prints the worst-case blocking every RT_REPORT_SECONDS meanwhile; the end of stdin
+// then tells every worker to leave, and the report is printed once more after the join
+void executor_run(void) {
+	struct pollfd in={.fd=STDIN_FILENO, .events=POLLIN};
+	char line[256], cmd[16], arg[32];
+	int i, k, o, n;
+
+	setvbuf(stdin,NULL,_IONBF,0); // one read per line, so poll sees what is left
+	FOREVER {
+		if(rt && poll(&in,1,RT_REPORT_SECONDS*1000)==0) {
+			rt_report_once();
+			continue;
+		}
+		if(fgets(line,sizeof(line),stdin)==NULL)
+			break;
+		executor_reap(FALSE);
+		n=sscanf(line,"%15s %31s",cmd,arg);
+		if(n<1)
+			continue;
+		if(strcmp(cmd,"join")==0) {
+			if(n==2 && !executor_shape(arg,&k,&o)) {
+				printf("Bad worker shape %s, expected KxO with K and O in 3, 5, 10\n", arg);
+				continue;
+			}
+			if(n==1)
+				k=o=0;
+			if((i=executor_join(k,o))>=0)
+				printf("Worker %s joined.\n", workers[i].name);
+		}
+		else if(strcmp(cmd,"leave")==0) {
+			if(n==2) {
+				i=arg[0]=='t'?atoi(arg+1):-1;
+				if(i<0 || i>=MAX_THREADS || !workers[i].alive || atomic_load(&workers[i].leave))
+					i=-1;
+			}
+			else
+				for(i=MAX_THREADS-1;i>=0 && (!workers[i].alive || atomic_load(&workers[i].leave));i--);
+			if(i<0) {
+				printf("No such worker.\n");
+				continue;
+			}
+			atomic_store(&workers[i].leave,1);
+			printf("Worker %s leaves after its current step.\n", workers[i].name);
+		}
+		else if(strcmp(cmd,"list")==0)
+			executor_list();
+		else
+			printf("Unknown command %s (join [KxO], leave [tN], list)\n", cmd);
+		fflush(stdout);
+	}
+	if(rt) { // every worker leaves, and closing the monitor frees those still blocked
+		for(i=0;i<MAX_THREADS;i++)
+			if(workers[i].alive)
+				atomic_store(&workers[i].leave,1);
+		monitor_close(&mon);
+	}
+	executor_reap(TRUE);
+	if(rt)
+		rt_report_once();
+}
+
+// CALLS IN PROGRESS
+// with -F or -D, every worker keeps the monitor call it is in, if any, in its own slot of
+// calls[] (indexed like workers[]), so that rt_report_once and the watchdog also see the
+// calls that have not returned. Only the worker writes its slot
+typedef struct call_t {
+	_Alignas(64) atomic_long start_ns; // 0 outside monitor calls
+	atomic_int op, class, size; // op is 0 for download, 1 for upload; size is k for downloads
+	atomic_ulong done; // calls returned so far
+	atomic_int running; // the worker is between call_thread_start and call_thread_stop
+} call_t;
+
+call_t calls[MAX_THREADS];
+_Thread_local call_t *call_self;
+
+long now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec*1000000000L+ts.tv_nsec;
+}
+
+// once worker i knows its k; in real-time mode it also takes the priority of its k
+void call_thread_start(int i, int k) {
+	call_self=&calls[i];
+	atomic_store(&call_self->start_ns,0);
+	atomic_store(&call_self->running,1);
+	if(rt)
+		pthread_setschedprio(pthread_self(), RT_PRIORITY+size_class(k));
+}
+
+void call_thread_stop(void) {
+	atomic_store(&call_self->running,0);
+}
+
+// the calling worker enters a monitor call: EV_DOWNLOAD (size is k) or EV_UPLOAD (size of
+// the vector)
+void call_enter(int op, int size) {
+	atomic_store_explicit(&call_self->op,op==EV_UPLOAD,memory_order_relaxed);
+	atomic_store_explicit(&call_self->class,size_class(size),memory_order_relaxed);
+	atomic_store_explicit(&call_self->size,size,memory_order_relaxed);
+	atomic_store_explicit(&call_self->start_ns,now_ns(),memory_order_release);
+}
+
+// the call returned; in real-time mode its blocking time goes to rt_worst_ns
+void call_leave(void) {
+	atomic_long *worst=&rt_worst_ns[atomic_load_explicit(&call_self->op,memory_order_relaxed)][atomic_load_explicit(&call_self->class,memory_order_relaxed)];
+	long ns=now_ns()-atomic_load_explicit(&call_self->start_ns,memory_order_relaxed), seen;
+
+	atomic_store_explicit(&call_self->start_ns,0,memory_order_relaxed);
+	atomic_store_explicit(&call_self->done,atomic_load_explicit(&call_self->done,memory_order_relaxed)+1,memory_order_release);
+	if(!rt)
+		return;
+	seen=atomic_load_explicit(worst,memory_order_relaxed);
+	while(ns>seen && !atomic_compare_exchange_weak_explicit(worst,&seen,ns,memory_order_relaxed,memory_order_relaxed));
+}
+
+// WATCHDOG
+// -D ms starts a thread that looks at the workers every ms/4, reading calls[] and the
+// monitor without locks, and reports on stderr
+// - a stall: no call returned for ms while every running worker is inside one, as when
+//   they all wait to upload and the record at the head is too long for the downloaders,
+//   or all wait to download from an empty buffer
+// - starvation: a worker is inside the same call for ms while the others returned from
+//   more than WATCHDOG_SKIPS calls, as a long upload can be under SVF
+// each with a snapshot of the workers, of the records in the buffer and of the waiting
+// threads (see the snapshot hook of the engines). -A says what else happens on a stall:
+// unjam takes the record at the head out of the buffer, since no waiter can take it, or
+// puts a vector of size 3 in an empty buffer, calling the monitor like any thread; close
+// closes the monitor, so that every call returns and the workers leave, and ends the
+// program. A stall is reported once until calls return again, or again after ms with
+// unjam if that was not enough; a starved call once
+void watchdog_snapshot(long now) {
+	const char *ops[2]={"download","upload"};
+	long start;
+	int i;
+
+	fprintf(stderr,"Workers:\n");
+	for(i=0;i<MAX_THREADS;i++) {
+		if(!atomic_load(&calls[i].running))
+			continue;
+		start=atomic_load_explicit(&calls[i].start_ns,memory_order_acquire);
+		if(start!=0)
+			fprintf(stderr,"  %s: %s of %d for %ld ms", workers[i].name, ops[atomic_load(&calls[i].op)],
+				atomic_load(&calls[i].size), (now-start)/1000000);
+		else
+			fprintf(stderr,"  %s: outside the monitor", workers[i].name);
+		fprintf(stderr,", %lu calls returned\n", atomic_load(&calls[i].done));
+	}
+	fprintf(stderr,"Monitor (%s engine, %s policy):\n", mon.engine->name, mon.policy->name);
+	mon.engine->snapshot(&mon,stderr);
+	fflush(stderr);
+}
+
+void watchdog_unjam(void) {
+	vector_t V={.size=3};
+	// never waits: the head may be a record still being written (-z), or the turn of
+	// a queued uploader, and a watchdog stuck in the monitor would not see the next stall
+	if(mon.engine->free_slots(&mon)==mon.size) {
+		if(mon.engine->upload_nowait(&mon,&V))
+			fprintf(stderr,"Watchdog: put a vector of 3 in the empty buffer.\n");
+		else
+			fprintf(stderr,"Watchdog: could not put a vector in the buffer now.\n");
+	}
+	else if(mon.engine->download_nowait(&mon,MAX_VSIZE,&V))
+		fprintf(stderr,"Watchdog: dropped the vector of %d at the head of the buffer.\n", V.size);
+	else
+		fprintf(stderr,"Watchdog: could not drop the head of the buffer now.\n");
+}
+
+void watchdog_close(void) {
+	int i, left;
+
+	fprintf(stderr,"Watchdog: closing the monitor.\n");
+	monitor_close(&mon);
+	for(i=0;i<MAX_THREADS;i++)
+		atomic_store(&workers[i].leave,1);
+	do {
+		usleep(1000);
+		for(left=0,i=0;i<MAX_THREADS;i++)
+			left+=atomic_load(&calls[i].running);
+	} while(left>0);
+	fflush(stdout);
+	log_stop();
+	_exit(EXIT_FAILURE); // main may be blocked reading stdin
+}
+
+void *watchdog_thread(void *arg) {
+	long period=watchdog_ms*1000000L/4, threshold=watchdog_ms*1000000L, now, start, last_progress;
+	long seen_start[MAX_THREADS]={0};
+	unsigned long total, last_total=0, seen_total[MAX_THREADS];
+	boolean stall_reported=FALSE, starved[MAX_THREADS]={FALSE};
+	struct timespec ts={period/1000000000L, period%1000000000L};
+	int i, running, blocked;
+
+	(void)arg;
+	last_progress=now_ns();
+	FOREVER {
+		nanosleep(&ts,NULL);
+		now=now_ns();
+		for(total=0,running=blocked=0,i=0;i<MAX_THREADS;i++)
+			if(atomic_load(&calls[i].running)) {
+				running++;
+				total+=atomic_load(&calls[i].done);
+				blocked+=atomic_load(&calls[i].start_ns)!=0;
+			}
+
+		// starvation: the same call, seen by its start, while the others go on
+		for(i=0;i<MAX_THREADS;i++) {
+			start=atomic_load(&calls[i].running)?atomic_load_explicit(&calls[i].start_ns,memory_order_acquire):0;
+			if(start!=seen_start[i]) {
+				seen_start[i]=start;
+				seen_total[i]=total;
+				starved[i]=FALSE;
+			}
+			else if(start!=0 && !starved[i] && now-start>=threshold && total-seen_total[i]>WATCHDOG_SKIPS) {
+				starved[i]=TRUE;
+				fprintf(stderr,"Watchdog: %s starved, %lu calls returned since it waits.\n", workers[i].name, total-seen_total[i]);
+				watchdog_snapshot(now);
+			}
+		}
+
+		if(total!=last_total) {
+			last_total=total;
+			last_progress=now;
+			stall_reported=FALSE;
+		}
+		else if(running>0 && blocked==running && now-last_progress>=threshold && !stall_reported) {
+			fprintf(stderr,"Watchdog: stall, no call returned for %ld ms and all %d workers wait in the monitor.\n",
+				(now-last_progress)/1000000, running);
+			watchdog_snapshot(now);
+			stall_reported=TRUE;
+			if(watchdog_action==WATCHDOG_UNJAM) {
+				watchdog_unjam();
+				last_progress=now_ns();
+				stall_reported=FALSE;
+			}
+			else if(watchdog_action==WATCHDOG_CLOSE)
+				watchdog_close();
+		}
+	}
+	return NULL;
+}
+
+void watchdog_start(void) {
+	pthread_t tid;
+	if((errno=pthread_create(&tid,NULL,watchdog_thread,NULL))!=0) {
+		perror("Cannot start the watchdog");
+		exit(1);
+	}
+	pthread_detach(tid);
+}
+
+// REAL-TIME MODE
+// -F runs the threads under SCHED_FIFO, each pinned to a CPU, with priorities following
+// the download order of the monitor: threads with k=10 are served first, so they run at
+// RT_PRIORITY+2, k=5 at +1 and k=3 at RT_PRIORITY. Monitor mutexes inherit priorities
+// (see monitor_mutex_init) and memory is locked, so no page fault happens inside the
+// monitor. Every thread times its monitor calls and main prints the longest blocking
+// seen per call and size class
+
+void rt_init(void) {
+	if(mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		perror("Cannot lock memory (needs CAP_IPC_LOCK or a larger RLIMIT_MEMLOCK)");
+		exit(1);
+	}
+	for(int op=0;op<2;op++)
+		for(int c=0;c<3;c++)
+			atomic_init(&rt_worst_ns[op][c],0);
+}
+
+// thread i starts at the lowest real-time priority, on CPU i modulo the CPUs online
+void rt_thread_attr(pthread_attr_t *attr, int i) {
+	struct sched_param param = {.sched_priority = RT_PRIORITY};
+	cpu_set_t cpus;
+
+	pthread_attr_init(attr);
+	pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+	pthread_attr_setschedparam(attr, &param);
+	CPU_ZERO(&cpus);
+	CPU_SET(i % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+	pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus);
+}
+
+// printed every RT_REPORT_SECONDS by executor_run; calls still blocked count with the
+// time they have waited so far
+void rt_report_once(void) {
+	const char *ops[2]={"download","upload"};
+	long worst[2][3], start, now;
+	int op, c, i;
+
+	for(op=0;op<2;op++)
+		for(c=0;c<3;c++)
+			worst[op][c]=atomic_load(&rt_worst_ns[op][c]);
+	now=now_ns();
+	for(i=0;i<MAX_THREADS;i++) {
+		start=atomic_load_explicit(&calls[i].start_ns,memory_order_acquire);
+		op=atomic_load_explicit(&calls[i].op,memory_order_relaxed);
+		c=atomic_load_explicit(&calls[i].class,memory_order_relaxed);
+		if(start!=0 && now-start>worst[op][c])
+			worst[op][c]=now-start;
+	}
+	printf("Worst-case blocking (us):");
+	for(op=0;op<2;op++)
+		for(c=0;c<3;c++)
+			printf(" %s%d %.1f", ops[op], class_size[c], worst[op][c]/1000.0);
+	printf("\n");
+	fflush(stdout);
+}
+
+// one step of the thread loop without copies (-z): the kernel reads the vector where it
+// lies in the buffer and writes the result straight into room reserved for it. A span
+// that wraps (only without the mirrored mapping) goes through a local vector. If there is no room right away, the vector is
+// copied and released before a normal upload, since waiting for room while holding it
+// could deadlock. Engines without zero-copy access get a plain download and upload.
+// The kernels may load a few slots past the end of the vector and mask them off; ring_map
+// leaves room for that
+boolean zerocopy_step(monitor_t *mon, int k, matrix_t *M, packed_matrix_t *P) {
+	span_t Sin, Sout;
+	vector_t Vin, Vout, *in, *out;
+
+	if(mon->engine->download_begin==NULL) {
+		if(!download(mon,k,&Vin))
+			return FALSE;
+		in=&Vin;
+	}
+	else {
+		if(!download_begin(mon,k,&Sin))
+			return FALSE;
+		if((in=span_vector(&Sin))==NULL) {
+			span_read(&Sin,&Vin);
+			in=&Vin;
+		}
+		if(upload_begin(mon,M->m,&Sout,FALSE)) {
+			if((out=span_vector(&Sout))==NULL)
+				out=&Vout;
+			if(packed)
+				packed_multiply(P,in,out);
+			else
+				fast_multiply(M,in,out);
+			if(out==&Vout)
+				span_write(&Sout,&Vout);
+			upload_commit(mon,&Sout);
+			download_end(mon,&Sin);
+			return TRUE;
+		}
+		if(in!=&Vin) {
+			span_read(&Sin,&Vin);
+			in=&Vin;
+		}
+		download_end(mon,&Sin);
+	}
+	if(packed)
+		packed_multiply(P,in,&Vout);
+	else
+		fast_multiply(M,in,&Vout);
+	return upload(mon,&Vout);
+}
+
+// METRICS
+// every thread counts its monitor calls per operation and size class: calls, vectors
+// moved, calls that waited, wakeups that did not end the wait (n_wakeups counts them
+// engine by engine) and how long calls waited, from their first wait (LOG_WAIT) to the
+// end. One call in METRICS_SAMPLE is timed as a whole for the latency histogram, times
+// the hold of the monitor mutex if it takes one and reads the buffer occupancy; other
+// calls read no clock unless they wait. Counters have a single writer, so they are
+// updated with plain loads and stores, without locked instructions. The metrics thread
+// sums all threads into a snapshot, written to stderr on SIGUSR2 and to every client
+// connecting to the Unix socket given with -U (e.g. socat - UNIX-CONNECT:path)
+
+// histogram bucket of a latency: exact below 16 ns, then HIST_SUB buckets per power of two
+int hist_bucket(unsigned long ns)
+{
+    int e, b;
+    if (ns < 16)
+        return ns;
+    e = 63 - __builtin_clzl(ns);
+    b = 16 + (e - 4) * HIST_SUB + (int)((ns >> (e - 3)) & (HIST_SUB - 1));
+    return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+// highest latency that falls in bucket b
+unsigned long hist_value(int b)
+{
+    int e;
+    if (b < 16)
+        return b;
+    e = 4 + (b - 16) / HIST_SUB;
+    return ((unsigned long)(HIST_SUB + (b - 16) % HIST_SUB + 1) << (e - 3)) - 1;
+}
+
+// calls are timed with the TSC, a few times cheaper than clock_gettime
+
+// measures the TSC rate once, for the metrics and the spin budgets
+void tsc_calibrate(void)
+{
+    struct timespec t0, t1;
+    uint64_t c0, c1;
+
+    if (metrics_ns_per_tick != 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    c0 = __rdtsc();
+    usleep(20000);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c1 = __rdtsc();
+    metrics_ns_per_tick = (double)elapsed_ns(&t0, &t1) / (c1 - c0);
+}
+
+static inline long metrics_now_ns(void)
+{
+    return (long)(__rdtsc() * metrics_ns_per_tick);
+}
+
+// adds to a counter of the calling thread
+static inline void metrics_add(atomic_ulong *c, unsigned long n)
+{
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void metrics_max(atomic_ulong *c, unsigned long n)
+{
+    if (n > atomic_load_explicit(c, memory_order_relaxed))
+        atomic_store_explicit(c, n, memory_order_relaxed);
+}
+
+// slot of the calling thread, NULL once all are taken
+metrics_t *metrics_thread_slot(void)
+{
+    int i;
+    if (metrics_self == NULL && (i = atomic_fetch_add(&metrics_n_slots, 1)) < LOG_MAX_RINGS)
+        metrics_self = &metrics_slots[i];
+    return metrics_self;
+}
+
+// op as in metrics_end
+void metrics_begin(metrics_call_t *c, int op)
+{
+    metrics_t *m;
+    if (!METRICS || !metrics_on || (m = metrics_thread_slot()) == NULL)
+        return;
+    metrics_timed = ++m->sample[op == EV_UPLOAD] % METRICS_SAMPLE == 0;
+    c->start_ns = metrics_timed ? metrics_now_ns() : 0;
+    c->wakeups = n_wakeups;
+    c->spins = n_spins;
+    c->spin_hits = n_spin_hits;
+}
+
+void metrics_waiting(void)
+{
+    if (METRICS && metrics_on && wait_start_ns == 0)
+        wait_start_ns = metrics_now_ns();
+}
+
+// a call started with metrics_begin moved n vectors; op is EV_DOWNLOAD (size is k) or
+// EV_UPLOAD (size of the vectors)
+void metrics_end(monitor_t *mon, metrics_call_t *c, int op, int size, int n)
+{
+    metrics_t *m;
+    unsigned long ns, woken;
+    int cls;
+
+    if (!METRICS || !metrics_on || (m = metrics_thread_slot()) == NULL)
+        return;
+    woken = n_wakeups - c->wakeups;
+    op = op == EV_UPLOAD;
+    cls = size_class(size);
+    metrics_add(&m->calls[op][cls], 1);
+    metrics_add(&m->vectors[op][cls], n);
+    if (woken > 0 || wait_start_ns != 0) {
+        ns = wait_start_ns != 0 ? metrics_now_ns() - wait_start_ns : 0;
+        metrics_add(&m->waits[op][cls], 1);
+        metrics_add(&m->spurious[op][cls], woken > 0 ? woken - 1 : 0);
+        metrics_add(&m->blocked_ns[op][cls], ns);
+        metrics_max(&m->max_ns[op], ns);
+        metrics_add(&m->spins[op][cls], n_spins - c->spins);
+        metrics_add(&m->spin_hits[op][cls], n_spin_hits - c->spin_hits);
+        wait_start_ns = 0;
+    }
+    if (metrics_timed) {
+        int used = mon->size - mon->engine->free_slots(mon);
+        ns = metrics_now_ns() - c->start_ns;
+        metrics_add(&m->hist[op][hist_bucket(ns)], 1);
+        metrics_max(&m->max_ns[op], ns);
+        metrics_add(&m->occupancy_n, 1);
+        metrics_add(&m->occupancy_sum, used);
+        metrics_max(&m->occupancy_max, used);
+        metrics_timed = FALSE;
+    }
+}
+
+// the monitor mutex, timing a sample of the holds. A hold that waited on a condition
+// variable in between is not counted, as the mutex was released meanwhile
+void monitor_lock(monitor_t *mon)
+{
+    pthread_mutex_lock(&mon->mutex);
+    if (METRICS && metrics_timed) {
+        hold_start_ns = metrics_now_ns();
+        hold_wakeups = n_wakeups;
+    }
+}
+
+void monitor_unlock(monitor_t *mon)
+{
+    if (METRICS && hold_start_ns != 0) {
+        if (n_wakeups == hold_wakeups) {
+            unsigned long ns = metrics_now_ns() - hold_start_ns;
+            metrics_add(&metrics_self->holds, 1);
+            metrics_add(&metrics_self->hold_ns, ns);
+            metrics_max(&metrics_self->hold_max_ns, ns);
+        }
+        hold_start_ns = 0;
+    }
+    pthread_mutex_unlock(&mon->mutex);
+}
+
+#define METRICS_SUM(field) do { \
+        sum.field += atomic_load_explicit(&m->field, memory_order_relaxed); \
+    } while (0)
+
+// sums the metrics of all threads and writes them to f
+void metrics_dump(FILE *f)
+{
+    struct {
+        unsigned long calls[2][3], vectors[2][3], waits[2][3], spurious[2][3], blocked_ns[2][3];
+        unsigned long spins[2][3], spin_hits[2][3];
+        unsigned long holds, hold_ns, hold_max_ns, occupancy_n, occupancy_sum, occupancy_max;
+        unsigned long max_ns[2], hist[2][HIST_BUCKETS];
+    } sum;
+    const char *ops[2] = {"download", "upload"};
+    const double q[3] = {0.5, 0.99, 0.999};
+    int n = atomic_load(&metrics_n_slots), t, op, c, b, i;
+    unsigned long total, seen, v;
+
+    memset(&sum, 0, sizeof(sum));
+    for (t = 0; t < n && t < LOG_MAX_RINGS; t++) {
+        metrics_t *m = &metrics_slots[t];
+        for (op = 0; op < 2; op++) {
+            for (c = 0; c < 3; c++) {
+                METRICS_SUM(calls[op][c]);
+                METRICS_SUM(vectors[op][c]);
+                METRICS_SUM(waits[op][c]);
+                METRICS_SUM(spurious[op][c]);
+                METRICS_SUM(blocked_ns[op][c]);
+                METRICS_SUM(spins[op][c]);
+                METRICS_SUM(spin_hits[op][c]);
+            }
+            for (b = 0; b < HIST_BUCKETS; b++)
+                METRICS_SUM(hist[op][b]);
+            v = atomic_load_explicit(&m->max_ns[op], memory_order_relaxed);
+            sum.max_ns[op] = v > sum.max_ns[op] ? v : sum.max_ns[op];
+        }
+        METRICS_SUM(holds);
+        METRICS_SUM(hold_ns);
+        METRICS_SUM(occupancy_n);
+        METRICS_SUM(occupancy_sum);
+        v = atomic_load_explicit(&m->hold_max_ns, memory_order_relaxed);
+        sum.hold_max_ns = v > sum.hold_max_ns ? v : sum.hold_max_ns;
+        v = atomic_load_explicit(&m->occupancy_max, memory_order_relaxed);
+        sum.occupancy_max = v > sum.occupancy_max ? v : sum.occupancy_max;
+    }
+
+    fprintf(f, "op,class,calls,vectors,waits,spurious_wakeups,waited_ns,spins,spin_hits\n");
+    for (op = 0; op < 2; op++)
+        for (c = 0; c < 3; c++)
+            fprintf(f, "%s,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", ops[op], class_size[c], sum.calls[op][c],
+                sum.vectors[op][c], sum.waits[op][c], sum.spurious[op][c], sum.blocked_ns[op][c],
+                sum.spins[op][c], sum.spin_hits[op][c]);
+    for (op = 0; op < 2; op++) {
+        for (total = 0, b = 0; b < HIST_BUCKETS; b++)
+            total += sum.hist[op][b];
+        fprintf(f, "%s latency (ns, 1 in %d calls):", ops[op], METRICS_SAMPLE);
+        for (i = 0, seen = 0, b = 0; i < 3 && total > 0; i++) {
+            for (; b < HIST_BUCKETS && seen + sum.hist[op][b] < q[i] * total; b++)
+                seen += sum.hist[op][b];
+            v = hist_value(b < HIST_BUCKETS ? b : HIST_BUCKETS - 1);
+            fprintf(f, " p%g %lu", q[i] * 100, v < sum.max_ns[op] ? v : sum.max_ns[op]);
+        }
+        fprintf(f, " max %lu\n", sum.max_ns[op]);
+    }
+    fprintf(f, "mutex holds (1 in %d calls): %lu, mean %.0f ns, max %lu ns\n", METRICS_SAMPLE, sum.holds,
+        sum.holds ? (double)sum.hold_ns / sum.holds : 0.0, sum.hold_max_ns);
+    fprintf(f, "occupancy (1 in %d calls): mean %.1f, max %lu of %d slots\n", METRICS_SAMPLE,
+        sum.occupancy_n ? (double)sum.occupancy_sum / sum.occupancy_n : 0.0, sum.occupancy_max, mon.size);
+    fflush(f);
+}
+
+// waits for SIGUSR2 and for clients of the socket, if any
+void *metrics_thread(void *arg)
+{
+    int listener = (int)(intptr_t)arg, client, n;
+    struct pollfd fds[2];
+    struct signalfd_siginfo info;
+    sigset_t mask;
+    FILE *f;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    fds[0].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    fds[0].events = POLLIN;
+    fds[1].fd = listener;
+    fds[1].events = POLLIN;
+    n = listener >= 0 ? 2 : 1;
+    FOREVER {
+        if (poll(fds, n, -1) == -1)
+            continue;
+        if ((fds[0].revents & POLLIN) && read(fds[0].fd, &info, sizeof(info)) == sizeof(info))
+            metrics_dump(stderr);
+        if (n == 2 && (fds[1].revents & POLLIN) && (client = accept(listener, NULL, NULL)) >= 0) {
+            if ((f = fdopen(client, "w")) != NULL) {
+                metrics_dump(f);
+                fclose(f);
+            }
+            else
+                close(client);
+        }
+    }
+    return NULL;
+}
+
+// blocks SIGUSR2 in the calling thread, so in every thread created after, and starts the
+// metrics thread; path is the socket to create, NULL for none
+void metrics_start(const char *path)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    sigset_t mask;
+    pthread_t tid;
+    int listener = -1;
+
+    if (!METRICS)
+        return;
+    tsc_calibrate();
+    metrics_on = TRUE;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    if (path != NULL) {
+        if (strlen(path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Socket path too long: %s\n", path);
+            exit(1);
+        }
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(listener, 4) == -1) {
+            perror(path);
+            exit(1);
+        }
+    }
+    pthread_create(&tid, NULL, metrics_thread, (void *)(intptr_t)listener);
+    pthread_detach(tid);
+}
+
+// LOGGING
+// each thread appends fixed-size records to its own ring, without locks or stdio; the
+// drain thread started by log_start empties the rings into the trace file. A full ring
+// drops records instead of blocking the thread, drops are reported by log_stop
+
+// printf format of each event, applied to a and b
+const char *log_format[] = {
+    [EV_UPLOAD] = "uploaded V_%d\n",
+    [EV_DOWNLOAD] = "downloaded V_%d\n",
+    [EV_WAIT_DOWNLOAD] = "waiting to download %d\n",
+    [EV_WAIT_UPLOAD] = "waiting to upload V_%d\n",
+};
+
+void log_event(int level, int event, int a, int b)
+{
+    log_ring_t *r = log_ring;
+    log_record_t *rec;
+    struct timespec ts;
+    unsigned head;
+    int i;
+
+    if (r == NULL) {
+        pthread_mutex_lock(&log_free_lock);
+        if (log_n_free > 0)
+            r = log_free_rings[--log_n_free];
+        pthread_mutex_unlock(&log_free_lock);
+        if (r == NULL && atomic_load(&log_n_rings) < LOG_MAX_RINGS && (i = atomic_fetch_add(&log_n_rings, 1)) < LOG_MAX_RINGS)
+            r = &log_rings[i];
+        if (r == NULL) {
+            atomic_fetch_add_explicit(&log_no_ring, 1, memory_order_relaxed);
+            return; // no ring left for this thread
+        }
+        log_ring = r;
+    }
+    head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&r->tail, memory_order_acquire) == LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&r->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec = &r->rec[head % LOG_RING_SIZE];
+    rec->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    rec->thread = r - log_rings;
+    rec->level = level;
+    rec->event = event;
+    rec->a = a;
+    rec->b = b;
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+// gives the ring of the calling thread to the next thread that logs; for threads that
+// exit for good. The drain thread still writes what is left in it
+void log_release(void)
+{
+    if (log_ring == NULL)
+        return;
+    pthread_mutex_lock(&log_free_lock);
+    log_free_rings[log_n_free++] = log_ring;
+    pthread_mutex_unlock(&log_free_lock);
+    log_ring = NULL;
+}
+
+// writes the records available in every ring; returns how many
+int log_drain(void)
+{
+    int n = atomic_load(&log_n_rings), i, written = 0;
+    unsigned head, tail;
+    log_record_t *rec;
+
+    if (n > LOG_MAX_RINGS)
+        n = LOG_MAX_RINGS;
+    for (i = 0; i < n; i++) {
+        tail = atomic_load_explicit(&log_rings[i].tail, memory_order_relaxed);
+        head = atomic_load_explicit(&log_rings[i].head, memory_order_acquire);
+        for (; tail != head; tail++, written++) {
+            rec = &log_rings[i].rec[tail % LOG_RING_SIZE];
+            if (log_binary) {
+                fwrite(rec, sizeof(log_record_t), 1, log_file);
+            }
+            else {
+                fprintf(log_file, "%llu.%09llu t%u ", (unsigned long long)rec->ns / 1000000000,
+                    (unsigned long long)rec->ns % 1000000000, rec->thread);
+                fprintf(log_file, log_format[rec->event], rec->a, rec->b);
+            }
+        }
+        atomic_store_explicit(&log_rings[i].tail, tail, memory_order_release);
+    }
+    return written;
+}
+
+void *log_thread(void *arg)
+{
+    (void)arg;
+    while (atomic_load(&log_running)) {
+        if (log_drain() == 0) {
+            fflush(log_file);
+            usleep(1000);
+        }
+    }
+    log_drain();
+    fflush(log_file);
+    return NULL;
+}
+
+// opens the trace file (stdout if path is NULL) and starts the drain thread, unless logging is off
+void log_start(const char *path)
+{
+    if (LOG_LEVEL == LOG_OFF || log_level == LOG_OFF)
+        return;
+    log_file = path ? fopen(path, log_binary ? "wb" : "w") : stdout;
+    if (log_file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    atomic_store(&log_running, 1);
+    pthread_create(&log_tid, NULL, log_thread, NULL);
+}
+
+// drains what is left, stops the drain thread and reports dropped records
+void log_stop(void)
+{
+    unsigned long dropped = atomic_load(&log_no_ring);
+    int i;
+
+    if (!atomic_load(&log_running))
+        return;
+    atomic_store(&log_running, 0);
+    pthread_join(log_tid, NULL);
+    for (i = 0; i < LOG_MAX_RINGS; i++)
+        dropped += atomic_load(&log_rings[i].dropped);
+    if (dropped > 0)
+        fprintf(stderr, "Log: %lu records dropped\n", dropped);
+    if (log_file != stdout)
+        fclose(log_file);
+}
+
+// BENCHMARK MODE
+// ./A2 -B runs each combination of engines (-E), policies (-P), thread counts (-T), buffer
+// sizes (-S) and mixes of 3:5:10 vector sizes (-X), all comma separated lists, until the
+// threads did -n operations each (download, multiply, upload), and prints a CSV line per run.
+// Latencies are the time spent inside download/upload, blocked or not.
+#define BENCH_STALL_MS 1000 // a run with no progress for this long is stopped and marked as stalled
+
+typedef struct bench_thread_t {
+	_Alignas(64) atomic_long ops; // polled by the main thread
+	pthread_t tid;
+	int k, o;
+	matrix_t M;
+	packed_matrix_t P;
+	long n_samples; // latencies recorded, at most bench_iterations
+	uint32_t *download_ns, *upload_ns;
+	unsigned long wakeups, spins, spin_hits;
+} bench_thread_t;
+
+long elapsed_ns(struct timespec *a, struct timespec *b) {
+	return (b->tv_sec-a->tv_sec)*1000000000L+(b->tv_nsec-a->tv_nsec);
+}
+
+void *bench_thread(void *arg) {
+	bench_thread_t *t=(bench_thread_t *)arg;
+	vector_t Vin, Vout;
+	struct timespec t0, t1, t2, t3;
+	long ops=0;
+
+	n_wakeups=n_spins=n_spin_hits=0;
+	FOREVER {
+		if(zerocopy) { // one latency for the whole step, kept with the downloads
+			clock_gettime(CLOCK_MONOTONIC,&t0);
+			if(!zerocopy_step(&mon,t->k,&t->M,&t->P))
+				break;
+			clock_gettime(CLOCK_MONOTONIC,&t1);
+			if(t->n_samples<bench_iterations) {
+				t->download_ns[t->n_samples]=elapsed_ns(&t0,&t1);
+				t->upload_ns[t->n_samples]=0;
+				t->n_samples++;
+			}
+			atomic_store_explicit(&t->ops,++ops,memory_order_relaxed);
+			continue;
+		}
+		clock_gettime(CLOCK_MONOTONIC,&t0);
+		if(!download(&mon,t->k,&Vin))
+			break;
+		clock_gettime(CLOCK_MONOTONIC,&t1);
+		if(packed)
+			packed_multiply(&t->P,&Vin,&Vout);
+		else
+			fast_multiply(&t->M,&Vin,&Vout);
+		clock_gettime(CLOCK_MONOTONIC,&t2);
+		if(!upload(&mon,&Vout))
+			break;
+		clock_gettime(CLOCK_MONOTONIC,&t3);
+		if(t->n_samples<bench_iterations) {
+			t->download_ns[t->n_samples]=elapsed_ns(&t0,&t1);
+			t->upload_ns[t->n_samples]=elapsed_ns(&t2,&t3);
+			t->n_samples++;
+		}
+		atomic_store_explicit(&t->ops,++ops,memory_order_relaxed);
+	}
+	t->wakeups=n_wakeups;
+	t->spins=n_spins;
+	t->spin_hits=n_spin_hits;
+	log_release(); // the next runs start threads of their own
+	return NULL;
+}
+
+int compare_ns(const void *a, const void *b) {
+	uint32_t x=*(const uint32_t *)a, y=*(const uint32_t *)b;
+	return (x>y)-(x<y);
+}
+
+// picks 3, 5 or 10 with the weights in mix
+int mix_size(int mix[3]) {
+	int r=rng_below(&rng,mix[0]+mix[1]+mix[2]);
+	return r<mix[0]?3:(r<mix[0]+mix[1]?5:10);
+}
+
+// one run; prints its CSV line
+void bench_run(const engine_t *engine, const policy_t *policy, int threads, int size, int mix[3]) {
+	bench_thread_t *t=aligned_alloc(64,threads*sizeof(bench_thread_t));
+	uint32_t *download_ns, *upload_ns;
+	long ops, last_ops=0, total=0, n=0, target=threads*bench_iterations;
+	unsigned long wakeups=0, spins=0, spin_hits=0;
+	struct timespec start, now, progress;
+	boolean stalled=FALSE;
+	vector_t V;
+	int i;
+
+	monitor_init(&mon,engine,policy,size);
+	rng_seed(&rng,seed,0); // every run draws the same matrices
+	for(i=0;i<threads;i++) {
+		atomic_init(&t[i].ops,0);
+		t[i].k=mix_size(mix);
+		t[i].o=mix_size(mix);
+		init_matrix(&t[i].M,t[i].k,t[i].o);
+		pack_matrix(&t[i].P,&t[i].M);
+		t[i].n_samples=0;
+		t[i].download_ns=malloc(bench_iterations*sizeof(uint32_t));
+		t[i].upload_ns=malloc(bench_iterations*sizeof(uint32_t));
+	}
+	// fill up to half of the buffer with short vectors, that any thread can take
+	for(i=0;i<threads && (i+1)*4<=size/2;i++) {
+		V.size=3;
+		V.data[0]=V.data[1]=V.data[2]=i+1;
+		upload(&mon,&V);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC,&start);
+	progress=start;
+	for(i=0;i<threads;i++)
+		pthread_create(&t[i].tid,NULL,bench_thread,&t[i]);
+	FOREVER {
+		usleep(1000);
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		for(ops=0,i=0;i<threads;i++)
+			ops+=atomic_load_explicit(&t[i].ops,memory_order_relaxed);
+		if(ops>=target)
+			break;
+		if(ops!=last_ops) {
+			last_ops=ops;
+			progress=now;
+		}
+		else if(elapsed_ns(&progress,&now)>BENCH_STALL_MS*1000000L) {
+			stalled=TRUE;
+			break;
+		}
+	}
+	monitor_close(&mon);
+	for(i=0;i<threads;i++) {
+		pthread_join(t[i].tid,NULL);
+		total+=atomic_load(&t[i].ops);
+		wakeups+=t[i].wakeups;
+		spins+=t[i].spins;
+		spin_hits+=t[i].spin_hits;
+		n+=t[i].n_samples;
+	}
+	if(stalled)
+		now=progress;
+
+	// merge and sort the latencies
+	download_ns=malloc((n+1)*sizeof(uint32_t));
+	upload_ns=malloc((n+1)*sizeof(uint32_t));
+	for(n=0,i=0;i<threads;i++) {
+		memcpy(download_ns+n,t[i].download_ns,t[i].n_samples*sizeof(uint32_t));
+		memcpy(upload_ns+n,t[i].upload_ns,t[i].n_samples*sizeof(uint32_t));
+		n+=t[i].n_samples;
+		free(t[i].download_ns);
+		free(t[i].upload_ns);
+	}
+	download_ns[n]=upload_ns[n]=0; // so that an empty run reads zeros
+	qsort(download_ns,n,sizeof(uint32_t),compare_ns);
+	qsort(upload_ns,n,sizeof(uint32_t),compare_ns);
+
+#define PCT(a,p) (a)[(long)((p)*(n>0?n-1:0))]
+	printf("%s,%s,%d,%d,%d:%d:%d,%ld,%.3f,%.0f,%u,%u,%u,%u,%u,%u,%.3f,%.3f,%.3f,%d\n",
+		engine->name,engine->download==sh_download?"n/a":policy->name,threads,size,mix[0],mix[1],mix[2],
+		total,elapsed_ns(&start,&now)/1e9,total/(elapsed_ns(&start,&now)/1e9),
+		PCT(download_ns,0.5),PCT(download_ns,0.99),PCT(download_ns,0.999),
+		PCT(upload_ns,0.5),PCT(upload_ns,0.99),PCT(upload_ns,0.999),
+		total?(double)wakeups/total:0.0,total?(double)spins/total:0.0,spins?(double)spin_hits/spins:0.0,stalled);
+#undef PCT
+	fflush(stdout);
+
+	free(download_ns);
+	free(upload_ns);
+	free(t);
+	monitor_destroy(&mon);
+}
+
+// runs every combination of the comma separated lists
+void bench_main(char *engine_list, char *policy_list, char *thread_list, char *size_list, char *mix_list) {
+	char *e, *p, *th, *sz, *mx, *se, *sp, *st, *ss, *sm;
+	char el[256], pl[256], tl[256], sl[256], ml[256];
+	int i, n_policies, threads, size, mix[3];
+	const engine_t *engine;
+	const policy_t *policy;
+
+	printf("engine,policy,threads,buffer,mix,ops,seconds,ops_per_sec,"
+		"download_p50_ns,download_p99_ns,download_p999_ns,upload_p50_ns,upload_p99_ns,upload_p999_ns,"
+		"wakeups_per_op,spins_per_op,spin_hit_rate,stalled\n");
+	snprintf(el,sizeof(el),"%s",engine_list);
+	for(e=strtok_r(el,",",&se);e;e=strtok_r(NULL,",",&se)) {
+		for(i=0;i<N_ENGINES && strcmp(e,engines[i].name)!=0;i++);
+		if(i==N_ENGINES) {
+			fprintf(stderr,"Unknown engine %s\n",e);
+			exit(1);
+		}
+		engine=&engines[i];
+		snprintf(pl,sizeof(pl),"%s",policy_list);
+		n_policies=0;
+		for(p=strtok_r(pl,",",&sp);p;p=strtok_r(NULL,",",&sp)) {
+			for(i=0;i<N_POLICIES && strcmp(p,policies[i].name)!=0;i++);
+			if(i==N_POLICIES) {
+				fprintf(stderr,"Unknown policy %s\n",p);
+				exit(1);
+			}
+			policy=&policies[i];
+			// the sharded engine has no upload policy: one run is enough
+			if(engine->download==sh_download && n_policies++>0)
+				continue;
+			snprintf(tl,sizeof(tl),"%s",thread_list);
+			for(th=strtok_r(tl,",",&st);th;th=strtok_r(NULL,",",&st)) {
+				threads=atoi(th);
+				if(threads<1 || threads>MAX_THREADS) {
+					fprintf(stderr,"Thread count must be 1..%d\n",MAX_THREADS);
+					exit(1);
+				}
+				snprintf(sl,sizeof(sl),"%s",size_list);
+				for(sz=strtok_r(sl,",",&ss);sz;sz=strtok_r(NULL,",",&ss)) {
+					size=atoi(sz);
+					if(size<11 || size>MAX_BUFFER_SIZE) {
+						fprintf(stderr,"Buffer size must be 11..%d\n",MAX_BUFFER_SIZE);
+						exit(1);
+					}
+					snprintf(ml,sizeof(ml),"%s",mix_list);
+					for(mx=strtok_r(ml,",",&sm);mx;mx=strtok_r(NULL,",",&sm)) {
+						if(sscanf(mx,"%d:%d:%d",&mix[0],&mix[1],&mix[2])!=3 || mix[0]<0 || mix[1]<0 || mix[2]<0 || mix[0]+mix[1]+mix[2]==0) {
+							fprintf(stderr,"Mix must be a:b:c (weights of sizes 3, 5 and 10)\n");
+							exit(1);
+						}
+						bench_run(engine,policy,threads,size,mix);
+					}
+				}
+			}
+		}
+	}
+}
+
 // AUXILIARY FUNCTIONS
 double spend_some_time(int max_steps) {
     double x, sum=0.0, step;
-    long i, N_STEPS=rand()%(max_steps*1000000);
+    long i, N_STEPS=rng_below(&rng,max_steps*1000000);
     step = 1/(double)N_STEPS;
     for(i=0; i<N_STEPS; i++) {
         x = (i+0.5)*step;
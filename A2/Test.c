@@ -18,19 +18,247 @@
 #include <sys/wait.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "../A1/channel.h"
+#include "rng.h"
 
 #define TRUE 1
-#define N_WRITERS 5
+#define FALSE 0
+#define N_WRITERS 5 // default number of writers
+#define MAX_WRITERS 64
 #define BUF_SIZE 10
+#define BARRIER_SPINS 2000 // polls of the barrier before sleeping, on more than one CPU
+#define QUEUE_DEPTH 256 // default numbers read ahead of the writers
+#define MAX_QUEUE_DEPTH (1 << 20)
+#define SEED 100 // default seed of the writers' choices
 
 int buffer[BUF_SIZE]; // threads will have to write here
-int terminated; // to terminate writers
-int n = 0; // number read from master
-int received = 0; // number of writers that have written to buffer
+int n_writers = N_WRITERS; // -w
+int quiet = FALSE; // -q, no line per number and per update
+uint64_t seed = SEED; // -R, writer w draws from stream w+1 (see rng.h)
 
-pthread_cond_t cond;
 pthread_mutex_t m;
 
+// PIPELINE
+// the main thread only reads numbers from the master and queues them; every number is a
+// round, in which each writer adds it once. Writers meet at a barrier between rounds and
+// the last one to arrive takes the next number off the queue, so as long as the reader
+// is ahead the writers go through queued rounds back to back
+
+// bounded single producer, single consumer queue of numbers, the same protocol as the
+// master's ring in channel.h but private to the process: a side that finds the queue
+// empty (full) raises its waiting flag and sleeps on its wake word, and the other side
+// only makes the wake syscall if the flag is up
+typedef struct queue_t {
+	_Alignas(64) atomic_uint tail; // next slot the reader fills
+	atomic_uint closed; // no more numbers after tail
+	atomic_uint reader_waiting, reader_wake;
+	_Alignas(64) atomic_uint head; // next slot the writers take
+	atomic_uint writer_waiting, writer_wake;
+	_Alignas(64) unsigned mask; // depth-1, depth a power of two
+	int *slot;
+	// backpressure, each written by one side only
+	_Alignas(64) unsigned long full; // pushes that found the queue full and waited
+	unsigned long pushed;
+	unsigned max_used; // most numbers queued at once
+	_Alignas(64) unsigned long empty; // pops that found the queue empty and waited
+} queue_t;
+
+queue_t queue;
+
+typedef struct round_t {
+	int n; // number read from master
+	int last; // no more numbers: the writers stop
+} round_t;
+
+round_t current; // the current round, set at the barrier
+
+// sense-reversing barrier: every thread flips its own sense at each barrier and waits
+// until the last one to arrive sets the shared sense to the same value. Waiters poll
+// for a while and then sleep on sense with a futex; the last one only makes the wake
+// syscall if someone sleeps
+typedef struct barrier_t {
+	_Alignas(64) atomic_int left; // threads yet to arrive
+	atomic_uint sense;
+	atomic_int sleepers;
+	int parties, spins;
+} barrier_t;
+
+barrier_t barrier;
+
+void barrier_init(barrier_t *b, int parties) {
+	atomic_init(&b->left, parties);
+	atomic_init(&b->sense, 0);
+	atomic_init(&b->sleepers, 0);
+	b->parties = parties;
+	b->spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? BARRIER_SPINS : 0;
+}
+
+// sense is the caller's own, starting at 0; the last thread to arrive runs last_in
+// before the others leave
+void barrier_wait(barrier_t *b, unsigned *sense, void (*last_in)(void)) {
+	int i;
+	*sense = !*sense;
+	if(atomic_fetch_sub(&b->left, 1) == 1) {
+		if(last_in != NULL)
+			last_in();
+		atomic_store(&b->left, b->parties);
+		atomic_store(&b->sense, *sense);
+		if(atomic_load(&b->sleepers) > 0)
+			channel_futex(&b->sense, FUTEX_WAKE_PRIVATE, INT32_MAX);
+		return;
+	}
+	for(i=0; i<b->spins && atomic_load(&b->sense) != *sense; i++)
+		__builtin_ia32_pause();
+	while(atomic_load(&b->sense) != *sense) {
+		atomic_fetch_add(&b->sleepers, 1);
+		channel_futex(&b->sense, FUTEX_WAIT_PRIVATE, !*sense);
+		atomic_fetch_sub(&b->sleepers, 1);
+	}
+}
+
+void queue_init(queue_t *q, int depth) {
+	unsigned size;
+	for(size=1; size<(unsigned)depth; size<<=1);
+	memset(q, 0, sizeof(*q));
+	q->mask=size-1;
+	q->slot=malloc(size*sizeof(int));
+	if(q->slot==NULL) {
+		perror("Error allocating queue");
+		exit(1);
+	}
+}
+
+void queue_push(queue_t *q, int n) {
+	unsigned t=atomic_load_explicit(&q->tail, memory_order_relaxed), seq, used;
+	if(t-atomic_load(&q->head) > q->mask) {
+		q->full++;
+		while(t-atomic_load(&q->head) > q->mask) {
+			seq=atomic_load(&q->reader_wake);
+			atomic_store(&q->reader_waiting, 1);
+			if(t-atomic_load(&q->head) > q->mask)
+				channel_futex(&q->reader_wake, FUTEX_WAIT_PRIVATE, seq);
+			atomic_store(&q->reader_waiting, 0);
+		}
+	}
+	q->slot[t & q->mask]=n;
+	atomic_store(&q->tail, t+1);
+	q->pushed++;
+	used=t+1-atomic_load_explicit(&q->head, memory_order_relaxed);
+	if(used > q->max_used)
+		q->max_used=used;
+	if(atomic_load(&q->writer_waiting)) {
+		atomic_fetch_add(&q->writer_wake, 1);
+		channel_futex(&q->writer_wake, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+void queue_close(queue_t *q) {
+	atomic_store(&q->closed, 1);
+	atomic_fetch_add(&q->writer_wake, 1);
+	channel_futex(&q->writer_wake, FUTEX_WAKE_PRIVATE, 1);
+}
+
+// 1 with the next number in *n, 0 once the queue is closed and empty
+int queue_pop(queue_t *q, int *n) {
+	unsigned h=atomic_load_explicit(&q->head, memory_order_relaxed), seq;
+	if(atomic_load(&q->tail) == h) {
+		q->empty++;
+		while(atomic_load(&q->tail) == h) {
+			if(atomic_load(&q->closed) && atomic_load(&q->tail) == h)
+				return 0; // closed is set after the last number is queued
+			seq=atomic_load(&q->writer_wake);
+			atomic_store(&q->writer_waiting, 1);
+			if(atomic_load(&q->tail) == h && !atomic_load(&q->closed))
+				channel_futex(&q->writer_wake, FUTEX_WAIT_PRIVATE, seq);
+			atomic_store(&q->writer_waiting, 0);
+		}
+	}
+	*n=q->slot[h & q->mask];
+	atomic_store(&q->head, h+1);
+	if(atomic_load(&q->reader_waiting)) {
+		atomic_fetch_add(&q->reader_wake, 1);
+		channel_futex(&q->reader_wake, FUTEX_WAKE_PRIVATE, 1);
+	}
+	return 1;
+}
+
+// UPDATE MODES
+// how a writer adds the number of the round to buffer[target] (-u). Only in mutex mode
+// do writers take m; in the others they never wait for each other within a round
+typedef struct update_t {
+	const char *name;
+	int locked; // add runs with m held
+	void (*add)(int w, int target, int n); // w is the writer, 0..n_writers-1
+	void (*round_done)(void); // once all updates of a round are applied, before the next one
+	void (*finish)(void); // after the writers are joined, leaves the result in buffer
+} update_t;
+
+// one cache line per slot or per writer, so that writers do not share lines
+typedef struct padded_slot_t {
+	_Alignas(64) atomic_int v;
+} padded_slot_t;
+
+typedef struct shadow_t {
+	_Alignas(64) int v[BUF_SIZE];
+} shadow_t;
+
+padded_slot_t slots[BUF_SIZE]; // atomic mode
+shadow_t shadow[MAX_WRITERS]; // shadow mode
+
+void mutex_add(int w, int target, int n) {
+	(void)w;
+	buffer[target] += n;
+	if(!quiet)
+		printf("Summing %d, updated buffer[%d] to %d\n", n, target, buffer[target]);
+}
+
+void nothing(void) {
+}
+
+// every slot on its own line, updated with one atomic add
+void atomic_add(int w, int target, int n) {
+	int v=atomic_fetch_add_explicit(&slots[target].v, n, memory_order_relaxed)+n;
+	(void)w;
+	if(!quiet)
+		printf("Summing %d, updated buffer[%d] to %d\n", n, target, v);
+}
+
+void atomic_finish(void) {
+	int i;
+	for(i=0;i<BUF_SIZE;i++)
+		buffer[i]=atomic_load(&slots[i].v);
+}
+
+// moves what the writers added to their shadows into buffer; runs at the barrier at the
+// end of each round, when no writer is adding, and the barrier orders it after their adds
+void shadow_merge(void) {
+	int w, i;
+	for(w=0;w<n_writers;w++)
+		for(i=0;i<BUF_SIZE;i++)
+			if(shadow[w].v[i] != 0) {
+				buffer[i]+=shadow[w].v[i];
+				shadow[w].v[i]=0;
+			}
+}
+
+// every writer adds to its own copy of the buffer, merged into buffer when the round is
+// complete; nobody else touches the copy during a round, so a plain add is enough
+void shadow_add(int w, int target, int n) {
+	shadow[w].v[target]+=n;
+	if(!quiet)
+		printf("Summing %d into buffer[%d]\n", n, target);
+}
+
+const update_t updates[] = {
+	{"mutex", TRUE, mutex_add, nothing, nothing},
+	{"shadow", FALSE, shadow_add, shadow_merge, shadow_merge},
+	{"atomic", FALSE, atomic_add, nothing, atomic_finish},
+};
+#define N_UPDATES (sizeof(updates) / sizeof(updates[0]))
+const update_t *update = &updates[0];
+
 void display_buffer() {
 	int i;
 	printf("Buffer:\n|");
@@ -40,101 +268,148 @@ void display_buffer() {
 	puts("");
 }
 
+// run by the last writer to reach the barrier: ends the round and sets up the next one
+void next_round(void) {
+	update->round_done();
+	current.last=!queue_pop(&queue, &current.n);
+}
+
 void *writer(void *arg) {
+	int w=(int)(intptr_t)arg;
+	unsigned sense=0, r;
+	rng_t rng;
 
-	while(!terminated) {
-		int target=rand()%BUF_SIZE;
+	rng_seed(&rng, seed, w+1);
+	for(r=0;;r++) {
+		int target=rng_below(&rng, BUF_SIZE);
+
+		barrier_wait(&barrier, &sense, next_round); // round r starts
+		if(current.last)
+			break;
 
 		// update buffer[target]
-		pthread_mutex_lock(&m);
-
-			while (received == 0){ 
-				//printf("Waiting for signal\n");
-				pthread_cond_wait(&cond, &m); }
-			received--;
-			buffer[target] += n;
-			printf("Summing %d, updated buffer[%d] to %d\n", n, target, buffer[target]);
+		if(update->locked) {
+			pthread_mutex_lock(&m);
+			update->add(w, target, current.n);
 			//display_buffer();
-		
-		pthread_mutex_unlock(&m);		
-	
+			pthread_mutex_unlock(&m);
+		}
+		else
+			update->add(w, target, current.n);
 	}
 	puts("Writer terminated. Bye!");
 
 	pthread_exit(NULL);
 }
 
-int main(void) {
-	// set up mutex and condition variable
+int main(int argc, char *argv[]) {
+	// set up mutex
 	pthread_mutex_init(&m, NULL);
-	pthread_cond_init(&cond, NULL);
 
-	pthread_t tid[N_WRITERS];
-	int i, accumulator=0;
+	pthread_t tid[MAX_WRITERS];
+	int i, opt, id=0, accumulator=0, n=0, depth=QUEUE_DEPTH;
+	channel_mode_t mode=CHANNEL_SHMEM;
+	channel_t ch;
+
+	// command line: -t shm|fifo selects the channel to the master, the same as the master's;
+	// -i is the id of this slave, 0 up to the number of slaves of the master; -w sets the
+	// number of writers, -u how they update the buffer, -d how many numbers can be read
+	// ahead of them, -R seeds where they add and -q stops the line per update
+	while((opt=getopt(argc, argv, "t:i:w:u:d:R:q")) != -1) {
+		if(opt=='t' && channel_parse_mode(optarg, &mode) == 0)
+			continue;
+		else if(opt=='i' && atoi(optarg) >= 0)
+			id=atoi(optarg);
+		else if(opt=='w' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_WRITERS)
+			n_writers=atoi(optarg);
+		else if(opt=='u') {
+			for(i=0;i<(int)N_UPDATES && strcmp(optarg, updates[i].name)!=0;i++);
+			if(i==(int)N_UPDATES) {
+				fprintf(stderr, "Unknown update mode %s\n", optarg);
+				exit(1);
+			}
+			update=&updates[i];
+		}
+		else if(opt=='d' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_QUEUE_DEPTH)
+			depth=atoi(optarg);
+		else if(opt=='R')
+			seed=strtoull(optarg, NULL, 0);
+		else if(opt=='q')
+			quiet=TRUE;
+		else {
+			fprintf(stderr, "Usage: %s [-t shm|fifo] [-i id] [-w 1..%d] [-u mutex|shadow|atomic] [-d 1..%d] [-R seed] [-q]\n", argv[0], MAX_WRITERS, MAX_QUEUE_DEPTH);
+			exit(1);
+		}
+	}
 
 	// sanity check
-	if(N_WRITERS<1) {
+	if(n_writers<1) {
 		puts("Bye!");
 		exit(1);
 	}
 
 	puts("!!!Hello World - I'm the slave!!!"); /* prints !!!Hello World!!! */
 
-	// set up seed
-	srand(100);
-
 	// set up communication with master
-	printf("Opening FIFO, waiting for master to be ready...\n");
+	printf(mode==CHANNEL_PIPE ? "Opening FIFO, waiting for master to be ready...\n" : "Opening shared memory channel, waiting for master to be ready...\n");
 
-	int fd = open("/tmp/named_pipe", O_RDONLY);	
-	if(fd==-1) {
-		perror("Error opening named pipe");
+	if(channel_open_reader(&ch, mode, id) == -1) {
+		perror("Error opening channel");
 		exit (1);
 	}
 
-	printf("Opened named pipe, master's ready\n");
+	printf(mode==CHANNEL_PIPE ? "Opened named pipe, master's ready\n" : "Opened channel, master's ready\n");
+
+	// the writers meet at the barrier, fed through the queue
+	queue_init(&queue, depth);
+	barrier_init(&barrier, n_writers);
 
 	// create threads
-	for(i=0;i<N_WRITERS;i++) {
-		if (pthread_create(&tid[i],NULL,writer,NULL) != 0) {
+	for(i=0;i<n_writers;i++) {
+		if (pthread_create(&tid[i],NULL,writer,(void *)(intptr_t)i) != 0) {
 			perror("Error creating thread");
 			exit(1);
 		}
 	}
 	
-	// enter wait loop
-	while(!terminated) {
+	// enter wait loop: read numbers and queue them for the writers, waiting only when
+	// depth of them are not taken yet
+	while(1) {
 		// read number from master
-		if(read(fd, &n, sizeof(int)) == -1) {
-			perror("Error reading from pipe");
+		switch(channel_recv(&ch, &n)) {
+		case -1:
+			perror("Error reading from channel");
 			exit (1);
+		case 0:
+			// if instead there are no more numbers to read, terminate
+			queue_close(&queue);
+			printf("All done, %d in total. Bye!\n", accumulator);
+			break;
+		default:
+			// if has read a number, queue a round for the writers
+			if(!quiet)
+				printf("Received %d\n", n);
+			queue_push(&queue, n);
+			accumulator += n;
+			continue;
 		}
-
-		// if has read a number, let all threads update the buffer
-		received = N_WRITERS;
-		printf("Received %d\n", n);
-		pthread_cond_broadcast(&cond);
-	
-		// if instead there are no more numbers to read, terminate
-		accumulator += n;
-		
-		if (accumulator >= 100){
-			terminated=TRUE;
-			puts("All done. Bye!");
-		}
+		break;
 	}
 
 	// tidy up
-	for(i=0;i<N_WRITERS;i++) {
+	for(i=0;i<n_writers;i++) {
 		if (pthread_join(tid[i],NULL) != 0) {
 			perror("Error joining thread");
 			exit(1);
 		}
 	}
+	update->finish();
+	printf("Queue of %u: %lu numbers, at most %u queued, reader waited %lu times, writers %lu\n",
+		queue.mask+1, queue.pushed, queue.max_used, queue.full, queue.empty);
+	free(queue.slot);
 
-	close(fd); // close fifo
+	channel_close(&ch, FALSE); // close channel
 	pthread_mutex_destroy(&m); // destroy mutex
-	pthread_cond_destroy(&cond); // destroy condition variable
 
 
 	// display content of buffer
@@ -0,0 +1,73 @@
+/*
+ ============================================================================
+ Name        : rng.h
+ Author      : Andrea Alboni
+ Version     : 1
+ Copyright   : For personal use only
+ Description : Per-thread random numbers for A2 and its slave: xoshiro256**
+               streams split from one seed
+ ============================================================================
+*/
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// rand() shares one state behind a lock, so threads drawing from it wait for each other
+// and what each one gets depends on how they interleave. Instead every thread owns a
+// generator: rng_seed derives its state from the run's seed and a stream number of the
+// thread's own (0 for main, then one per thread in creation order), so a run with the
+// same seed draws the same numbers in every thread whatever the scheduling
+typedef struct rng_t {
+	uint64_t s[4];
+} rng_t;
+
+// splitmix64, to spread a seed over the xoshiro state
+static inline uint64_t rng_splitmix(uint64_t *x) {
+	uint64_t z=(*x+=0x9E3779B97F4A7C15ULL);
+	z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+	z=(z^(z>>27))*0x94D049BB133111EBULL;
+	return z^(z>>31);
+}
+
+static inline void rng_seed(rng_t *r, uint64_t seed, uint64_t stream) {
+	// one splitmix step per stream apart, so streams start on unrelated states
+	uint64_t x=seed^rng_splitmix(&stream);
+	int i;
+	for(i=0;i<4;i++)
+		r->s[i]=rng_splitmix(&x);
+}
+
+static inline uint64_t rng_rotl(uint64_t x, int k) {
+	return (x<<k)|(x>>(64-k));
+}
+
+// xoshiro256**
+static inline uint64_t rng_next(rng_t *r) {
+	uint64_t *s=r->s, result=rng_rotl(s[1]*5,7)*9, t=s[1]<<17;
+	s[2]^=s[0];
+	s[3]^=s[1];
+	s[1]^=s[2];
+	s[0]^=s[3];
+	s[2]^=t;
+	s[3]=rng_rotl(s[3],45);
+	return result;
+}
+
+// uniform in [0,bound), bound>0, without the bias of a modulo (Lemire's method: the
+// high half of a 32x32 product, redrawing the few values that would favour low results)
+static inline uint32_t rng_below(rng_t *r, uint32_t bound) {
+	uint64_t m=(uint64_t)(uint32_t)(rng_next(r)>>32)*bound;
+	uint32_t low=(uint32_t)m, threshold;
+	if(low<bound) {
+		threshold=-bound%bound;
+		while(low<threshold) {
+			m=(uint64_t)(uint32_t)(rng_next(r)>>32)*bound;
+			low=(uint32_t)m;
+		}
+	}
+	return m>>32;
+}
+
+#endif